@@ -0,0 +1,1081 @@
+/**
+ * Buddy Allocator Benchmarks
+ *
+ * Each benchmark prints one line per configuration it measures. Run a subset
+ * by naming the benchmarks on the command line, e.g. `./bench free`.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+/**
+ * A named benchmark
+ */
+typedef struct bench_t {
+	const char *name;       ///< Name used to select the benchmark
+	void (*run)(void);      ///< Benchmark body
+} bench_t;
+
+/**
+ * Read the monotonic clock
+ *
+ * @return Current time in nanoseconds
+ */
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Free latency against the length of the smallest free list
+ *
+ * All pages are allocated, then every other page from the top of the arena is
+ * freed so free_area[MIN_ORDER] holds `len` blocks whose buddies are still in
+ * use. The timed loop frees page 0 (whose buddy is allocated, so nothing
+ * merges) and allocates it straight back.
+ */
+static void bench_free(void)
+{
+	enum { NPAGES = 256, ITERS = 200000 };
+	static void *pages[NPAGES];
+	int lens[] = { 0, 8, 32, 64, 127 };
+
+	for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		buddy_init();
+		for (int i = 0; i < NPAGES; i++)
+			pages[i] = buddy_alloc(4096);
+		for (int i = 0; i < lens[l]; i++)
+			buddy_free(pages[NPAGES - 1 - 2 * i]);
+
+		double start = now_ns();
+		for (int i = 0; i < ITERS; i++) {
+			buddy_free(pages[0]);
+			pages[0] = buddy_alloc(4096);
+		}
+		double elapsed = now_ns() - start;
+
+		assert(pages[0] != NULL);
+		printf("free: free-list length %3d: %7.1f ns per free+alloc\n",
+		       lens[l], elapsed / ITERS);
+	}
+}
+
+/**
+ * Shared state of one run of the scaling benchmark
+ */
+typedef struct scale_run_t {
+	buddy_arena_t *arena;   ///< Arena all threads allocate from
+	pthread_mutex_t *lock;  ///< Global lock around every call, or NULL
+	int iters;              ///< Allocations per thread
+} scale_run_t;
+
+/**
+ * Scaling benchmark thread: keep a small working set of blocks of 4K to 32K
+ * and replace a random one on every iteration.
+ */
+static void *scale_thread(void *arg)
+{
+	enum { WORKING_SET = 16 };
+	scale_run_t *run = arg;
+	void *blocks[WORKING_SET] = { NULL };
+	unsigned seed = (unsigned)(size_t)&blocks;
+
+	for (int i = 0; i < run->iters; i++) {
+		int slot = rand_r(&seed) % WORKING_SET;
+		size_t size = 4096UL << (rand_r(&seed) % 4);
+
+		if (run->lock)
+			pthread_mutex_lock(run->lock);
+		if (blocks[slot])
+			buddy_arena_free(run->arena, blocks[slot]);
+		blocks[slot] = buddy_arena_alloc(run->arena, size);
+		if (run->lock)
+			pthread_mutex_unlock(run->lock);
+	}
+
+	for (int i = 0; i < WORKING_SET; i++) {
+		if (blocks[i] == NULL)
+			continue;
+		if (run->lock)
+			pthread_mutex_lock(run->lock);
+		buddy_arena_free(run->arena, blocks[i]);
+		if (run->lock)
+			pthread_mutex_unlock(run->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * Throughput of 1 to N threads sharing one 64M arena, with per-order locking
+ * (BUDDY_CONCURRENT) and with one global mutex around an unlocked arena.
+ */
+static void bench_scale(void)
+{
+	enum { ORDER = 26, ITERS = 200000, MAX_THREADS = 8 };
+	static pthread_t threads[MAX_THREADS];
+	char *region = malloc(1UL << ORDER);
+	pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER;
+
+	for (int mode = 0; mode < 2; mode++) {
+		for (int n = 1; n <= MAX_THREADS; n *= 2) {
+			scale_run_t run = {
+				.arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER,
+							    mode == 0 ? BUDDY_CONCURRENT : 0),
+				.lock = mode == 0 ? NULL : &global,
+				.iters = ITERS,
+			};
+
+			double start = now_ns();
+			for (int t = 0; t < n; t++)
+				pthread_create(&threads[t], NULL, scale_thread, &run);
+			for (int t = 0; t < n; t++)
+				pthread_join(threads[t], NULL);
+			double elapsed = now_ns() - start;
+
+			printf("scale: %-13s %d threads: %6.2f Mops/s\n",
+			       mode == 0 ? "per-order" : "global mutex", n,
+			       (double)n * ITERS / elapsed * 1e3);
+			buddy_arena_destroy(run.arena);
+		}
+	}
+
+	free(region);
+}
+
+/**
+ * Small-block alloc/free with and without per-CPU caches, on a concurrent
+ * arena: every call without a cache takes at least one order lock and
+ * usually splits or merges.
+ */
+static void bench_pcp(void)
+{
+	enum { ORDER = 24, ITERS = 2000000, WORKING_SET = 64 };
+	char *region = malloc(1UL << ORDER);
+	static void *blocks[WORKING_SET];
+
+	for (int mode = 0; mode < 2; mode++) {
+		buddy_arena_t *arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER,
+							  BUDDY_CONCURRENT);
+		unsigned seed = 1;
+
+		if (mode == 1)
+			buddy_arena_set_pcp(arena, 16, 64, 16);
+
+		memset(blocks, 0, sizeof(blocks));
+
+		double start = now_ns();
+		for (int i = 0; i < ITERS; i++) {
+			int slot = rand_r(&seed) % WORKING_SET;
+
+			if (blocks[slot])
+				buddy_arena_free(arena, blocks[slot]);
+			blocks[slot] = buddy_arena_alloc(arena, 4096UL << (rand_r(&seed) % 3));
+		}
+		double elapsed = now_ns() - start;
+
+		printf("pcp: %-10s %6.1f ns per free+alloc\n",
+		       mode == 0 ? "no cache" : "per-CPU", elapsed / ITERS);
+		buddy_arena_destroy(arena);
+	}
+
+	free(region);
+}
+
+/**
+ * Shared state of one run of the lock-free benchmark
+ */
+typedef struct lockfree_run_t {
+	buddy_arena_t *arena;   ///< Arena all threads allocate from
+	int iters;              ///< Allocations per thread
+} lockfree_run_t;
+
+/**
+ * Lock-free benchmark thread: 4K blocks only, freed in batches of 8
+ */
+static void *lockfree_thread(void *arg)
+{
+	enum { BATCH = 8 };
+	lockfree_run_t *run = arg;
+	void *blocks[BATCH];
+
+	for (int i = 0; i < run->iters; i += BATCH) {
+		for (int b = 0; b < BATCH; b++)
+			blocks[b] = buddy_arena_alloc(run->arena, 4096);
+		for (int b = 0; b < BATCH; b++)
+			buddy_arena_free(run->arena, blocks[b]);
+	}
+
+	return NULL;
+}
+
+/**
+ * 4K alloc/free throughput of 1 to 4 threads on a concurrent arena, through
+ * the order lock and through the lock-free stack (BUDDY_LOCKFREE)
+ */
+static void bench_lockfree(void)
+{
+	enum { ORDER = 24, ITERS = 400000, MAX_THREADS = 4 };
+	static pthread_t threads[MAX_THREADS];
+	char *region = malloc(1UL << ORDER);
+
+	for (int mode = 0; mode < 2; mode++) {
+		for (int n = 1; n <= MAX_THREADS; n *= 2) {
+			lockfree_run_t run = {
+				.arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER,
+							    BUDDY_CONCURRENT |
+							    (mode == 1 ? BUDDY_LOCKFREE : 0)),
+				.iters = ITERS,
+			};
+
+			double start = now_ns();
+			for (int t = 0; t < n; t++)
+				pthread_create(&threads[t], NULL, lockfree_thread, &run);
+			for (int t = 0; t < n; t++)
+				pthread_join(threads[t], NULL);
+			double elapsed = now_ns() - start;
+
+			printf("lockfree: %-11s %d threads: %6.2f Mops/s\n",
+			       mode == 0 ? "order lock" : "Treiber", n,
+			       (double)n * ITERS / elapsed * 1e3);
+			buddy_arena_destroy(run.arena);
+		}
+	}
+
+	free(region);
+}
+
+/**
+ * Memory used by many small objects of 16 to 256 bytes, with each one taking
+ * a whole page and with BUDDY_SLAB packing them into size classes
+ */
+static void bench_slab(void)
+{
+	enum { ORDER = 26, NOBJS = 10000 };
+	char *region = malloc(1UL << ORDER);
+	static void *objs[NOBJS];
+
+	for (int mode = 0; mode < 2; mode++) {
+		buddy_arena_t *arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER,
+							  mode == 1 ? BUDDY_SLAB : 0);
+		unsigned seed = 1;
+		size_t requested = 0;
+		buddy_stats_t stats;
+
+		double start = now_ns();
+		for (int i = 0; i < NOBJS; i++) {
+			size_t size = 16 + rand_r(&seed) % 241;
+
+			objs[i] = buddy_arena_alloc(arena, size);
+			assert(objs[i] != NULL);
+			requested += size;
+		}
+		double elapsed = now_ns() - start;
+
+		buddy_arena_stats(arena, &stats);
+		size_t used = (1UL << ORDER) - stats.free_bytes;
+
+		printf("slab: %-7s %d objects, %zu KiB requested: %7zu KiB used (%5.2fx), %5.1f ns per alloc\n",
+		       mode == 0 ? "pages" : "slabs", NOBJS, requested >> 10, used >> 10,
+		       (double)used / requested, elapsed / NOBJS);
+
+		for (int i = 0; i < NOBJS; i++)
+			buddy_arena_free(arena, objs[i]);
+		buddy_arena_destroy(arena);
+	}
+
+	free(region);
+}
+
+/**
+ * Allocating a batch of equal blocks with buddy_arena_alloc_bulk() against a
+ * loop of buddy_arena_alloc(), starting from a fully merged arena each round
+ */
+static void bench_bulk(void)
+{
+	enum { ORDER = 26, ROUNDS = 2000, MAX_BATCH = 512 };
+	char *region = malloc(1UL << ORDER);
+	static void *blocks[MAX_BATCH];
+	buddy_arena_t *arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER, 0);
+	int batches[] = { 16, 128, 512 };
+
+	for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+		for (int mode = 0; mode < 2; mode++) {
+			int n = batches[b];
+			double elapsed = 0;
+
+			for (int r = 0; r < ROUNDS; r++) {
+				double start = now_ns();
+				if (mode == 0) {
+					for (int i = 0; i < n; i++)
+						blocks[i] = buddy_arena_alloc(arena, 4096);
+				} else {
+					int got = buddy_arena_alloc_bulk(arena, 4096, blocks, n);
+
+					assert(got == n);
+					(void)got;
+				}
+				elapsed += now_ns() - start;
+
+				for (int i = 0; i < n; i++)
+					buddy_arena_free(arena, blocks[i]);
+			}
+
+			printf("bulk: %3d x 4K %-5s %6.1f ns per block\n", n,
+			       mode == 0 ? "loop" : "bulk", elapsed / ROUNDS / n);
+		}
+	}
+
+	buddy_arena_destroy(arena);
+	free(region);
+}
+
+/**
+ * Tearing down a context of mixed 4K to 32K blocks, freed in random order
+ * one at a time and with one buddy_arena_free_bulk() call, in a plain and in
+ * a concurrent arena
+ */
+static void bench_free_bulk(void)
+{
+	enum { ORDER = 26, ROUNDS = 50, NBLOCKS = 4096 };
+	char *region = malloc(1UL << ORDER);
+	static void *blocks[NBLOCKS];
+
+	for (int mode = 0; mode < 4; mode++) {
+		buddy_arena_t *arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER,
+							  mode >= 2 ? BUDDY_CONCURRENT : 0);
+		unsigned seed = 1;
+		double elapsed = 0;
+
+		for (int r = 0; r < ROUNDS; r++) {
+			for (int i = 0; i < NBLOCKS; i++)
+				blocks[i] = buddy_arena_alloc(arena, 4096UL << (rand_r(&seed) % 4));
+			for (int i = NBLOCKS - 1; i > 0; i--) {
+				int j = rand_r(&seed) % (i + 1);
+				void *tmp = blocks[i];
+
+				blocks[i] = blocks[j];
+				blocks[j] = tmp;
+			}
+
+			double start = now_ns();
+			if (mode % 2 == 0) {
+				for (int i = 0; i < NBLOCKS; i++)
+					buddy_arena_free(arena, blocks[i]);
+			} else {
+				buddy_arena_free_bulk(arena, blocks, NBLOCKS);
+			}
+			elapsed += now_ns() - start;
+		}
+
+		// Everything freed coalesced back into one block
+		void *whole = buddy_arena_alloc(arena, 1UL << ORDER);
+
+		assert(whole != NULL);
+		(void)whole;
+		printf("free_bulk: %-10s %d blocks %-5s %6.1f ns per block\n",
+		       mode >= 2 ? "concurrent" : "plain", NBLOCKS,
+		       mode % 2 == 0 ? "loop" : "bulk", elapsed / ROUNDS / NBLOCKS);
+		buddy_arena_destroy(arena);
+	}
+
+	free(region);
+}
+
+/**
+ * Splits and merges per operation with eager and lazy coalescing, for one
+ * size allocated and freed in turn, and for a random working set of 4K to 32K
+ * blocks
+ */
+static void bench_lazy(void)
+{
+	enum { ORDER = 26, ITERS = 1000000, WORKING_SET = 64 };
+	char *region = malloc(1UL << ORDER);
+	static void *blocks[WORKING_SET];
+
+	for (int pattern = 0; pattern < 2; pattern++) {
+		for (int mode = 0; mode < 2; mode++) {
+			buddy_arena_t *arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER, 0);
+			unsigned seed = 1;
+			buddy_stats_t stats;
+
+			if (mode == 1)
+				buddy_arena_set_lazy(arena, 8);
+
+			memset(blocks, 0, sizeof(blocks));
+
+			double start = now_ns();
+			for (int i = 0; i < ITERS; i++) {
+				if (pattern == 0) {
+					buddy_arena_free(arena, buddy_arena_alloc(arena, 4096));
+					continue;
+				}
+
+				int slot = rand_r(&seed) % WORKING_SET;
+
+				if (blocks[slot])
+					buddy_arena_free(arena, blocks[slot]);
+				blocks[slot] = buddy_arena_alloc(arena, 4096UL << (rand_r(&seed) % 4));
+			}
+			double elapsed = now_ns() - start;
+
+			buddy_arena_stats(arena, &stats);
+			printf("lazy: %-10s %-5s %6.1f ns, %5.2f splits, %5.2f merges per alloc+free\n",
+			       pattern == 0 ? "ping-pong" : "random", mode == 0 ? "eager" : "lazy",
+			       elapsed / ITERS, (double)stats.nsplit / ITERS,
+			       (double)stats.nmerge / ITERS);
+			buddy_arena_destroy(arena);
+		}
+	}
+
+	free(region);
+}
+
+/**
+ * Growable log buffers: 16 buffers, each grown by 1K to 8K at a time up to
+ * 256K and then started over, with buddy_arena_realloc() and with
+ * allocate + memcpy + free
+ */
+static void bench_realloc(void)
+{
+	enum { ORDER = 26, ITERS = 200000, NBUFS = 16, LIMIT = 256 << 10 };
+	char *region = malloc(1UL << ORDER);
+	static void *bufs[NBUFS];
+	static size_t sizes[NBUFS];
+
+	for (int mode = 0; mode < 2; mode++) {
+		buddy_arena_t *arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER, 0);
+		unsigned seed = 1;
+		long moved = 0, outgrown = 0;
+
+		memset(bufs, 0, sizeof(bufs));
+		memset(sizes, 0, sizeof(sizes));
+
+		double start = now_ns();
+		for (int i = 0; i < ITERS; i++) {
+			int b = rand_r(&seed) % NBUFS;
+			size_t size = sizes[b] + 1024 * (1 + rand_r(&seed) % 8);
+			void *old = bufs[b];
+			size_t cap = 4096;
+
+			while (cap < sizes[b])
+				cap <<= 1;
+
+			if (size > LIMIT) {
+				buddy_arena_free(arena, bufs[b]);
+				bufs[b] = NULL;
+				sizes[b] = 0;
+				continue;
+			}
+
+			if (old == NULL || size <= cap) {
+				if (old == NULL)
+					bufs[b] = buddy_arena_alloc(arena, size);
+				sizes[b] = size;
+				continue;
+			}
+
+			outgrown++;
+			if (mode == 1) {
+				bufs[b] = buddy_arena_realloc(arena, old, size);
+			} else {
+				bufs[b] = buddy_arena_alloc(arena, size);
+				memcpy(bufs[b], old, sizes[b]);
+				buddy_arena_free(arena, old);
+			}
+
+			assert(bufs[b] != NULL);
+			moved += bufs[b] != old;
+			sizes[b] = size;
+		}
+		double elapsed = now_ns() - start;
+
+		printf("realloc: %-7s %6.1f ns per grow, %5.1f%% of outgrown blocks copied\n",
+		       mode == 0 ? "copy" : "realloc", elapsed / ITERS, 100.0 * moved / outgrown);
+		buddy_arena_destroy(arena);
+	}
+
+	free(region);
+}
+
+/**
+ * Internal fragmentation of odd-sized buffers of 64K to 1M, rounded up to a
+ * power of two and trimmed to whole pages (BUDDY_EXACT)
+ */
+static void bench_exact(void)
+{
+	enum { ORDER = 28, NBUFS = 200, ROUNDS = 200 };
+	char *region = malloc(1UL << ORDER);
+	static void *bufs[NBUFS];
+
+	for (int mode = 0; mode < 2; mode++) {
+		buddy_arena_t *arena = buddy_arena_create(region, 1UL << ORDER, 12, ORDER,
+							  mode == 1 ? BUDDY_EXACT : 0);
+		unsigned seed = 1;
+		size_t requested = 0, used = 0;
+		buddy_stats_t stats;
+
+		double start = now_ns();
+		for (int r = 0; r < ROUNDS; r++) {
+			for (int i = 0; i < NBUFS; i++) {
+				size_t size = (64 << 10) + rand_r(&seed) % (960 << 10);
+
+				bufs[i] = buddy_arena_alloc(arena, size);
+				assert(bufs[i] != NULL);
+				requested += size;
+			}
+
+			buddy_arena_stats(arena, &stats);
+			used += (1UL << ORDER) - stats.free_bytes;
+
+			for (int i = 0; i < NBUFS; i++)
+				buddy_arena_free(arena, bufs[i]);
+		}
+		double elapsed = now_ns() - start;
+
+		printf("exact: %-9s %5.1f%% of used memory wasted, %6.1f ns per alloc+free\n",
+		       mode == 0 ? "power-of-2" : "exact", 100.0 * (used - requested) / used,
+		       elapsed / ROUNDS / NBUFS);
+		buddy_arena_destroy(arena);
+	}
+
+	free(region);
+}
+
+/**
+ * Bytes of the process backed by transparent huge pages, from
+ * /proc/self/smaps_rollup
+ */
+static size_t anon_huge_bytes(void)
+{
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	char line[256];
+	size_t kb = 0;
+
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb << 10;
+}
+
+/**
+ * Random reads across 2M blocks of a 512M mapped arena, with 4K pages and
+ * with BUDDY_HUGEPAGE: every read of a 4K-backed block is likely a TLB miss
+ */
+static void bench_hugepage(void)
+{
+	enum { ORDER = 29, BLOCK = 21, ITERS = 20000000 };
+	enum { NBLOCKS = 1 << (ORDER - BLOCK) };
+	static char *blocks[NBLOCKS];
+
+	for (int mode = 0; mode < 2; mode++) {
+		buddy_arena_t *arena = buddy_arena_create(NULL, 1UL << ORDER, 12, ORDER,
+							  mode == 1 ? BUDDY_HUGEPAGE : 0);
+		unsigned long x = 1, sum = 0;
+
+		assert(arena != NULL);
+		for (int i = 0; i < NBLOCKS; i++) {
+			blocks[i] = buddy_arena_alloc(arena, 1UL << BLOCK);
+			memset(blocks[i], i, 1UL << BLOCK);
+		}
+		size_t huge = anon_huge_bytes();
+
+		double start = now_ns();
+		for (int i = 0; i < ITERS; i++) {
+			x = x * 6364136223846793005UL + 1442695040888963407UL;
+			sum += blocks[(x >> 33) % NBLOCKS][(x >> 11) & ((1UL << BLOCK) - 1)];
+		}
+		double elapsed = now_ns() - start;
+
+		printf("hugepage: %-9s %4zu MiB on huge pages, %5.1f ns per random read (%lu)\n",
+		       mode == 0 ? "4K pages" : "hugepage", huge >> 20, elapsed / ITERS, sum & 1);
+		buddy_arena_destroy(arena);
+	}
+}
+
+/**
+ * Resident set size of the process
+ */
+static size_t rss_bytes(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	size_t pages = 0, resident = 0;
+
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * RSS after a 256M spike of 1M blocks, then half a second of one hot 1M
+ * block being allocated, written and freed, with a 100 ms purge decay. The
+ * hot block must not be purged (and faulted in again) over and over.
+ */
+static void bench_purge(void)
+{
+	enum { ORDER = 28, BLOCK = 20, NBLOCKS = 256, DECAY_MS = 100, HOT_MS = 500 };
+	static void *blocks[NBLOCKS];
+	const char *modes[] = { "no purge", "DONTNEED", "FREE" };
+
+	for (int mode = 0; mode < 3; mode++) {
+		buddy_arena_t *arena = buddy_arena_create(NULL, 1UL << ORDER, 12, ORDER, 0);
+		size_t base = rss_bytes();
+		buddy_stats_t stats;
+		long hot = 0;
+
+		if (mode > 0)
+			buddy_arena_set_purge(arena, 16, DECAY_MS, mode == 2);
+
+		for (int i = 0; i < NBLOCKS; i++) {
+			blocks[i] = buddy_arena_alloc(arena, 1UL << BLOCK);
+			memset(blocks[i], 1, 1UL << BLOCK);
+		}
+		size_t spike = rss_bytes() - base;
+		for (int i = 0; i < NBLOCKS; i++)
+			buddy_arena_free(arena, blocks[i]);
+
+		double start = now_ns();
+		while (now_ns() - start < HOT_MS * 1e6) {
+			void *b = buddy_arena_alloc(arena, 1UL << BLOCK);
+
+			memset(b, 2, 1UL << BLOCK);
+			buddy_arena_free(arena, b);
+			hot++;
+		}
+		double elapsed = now_ns() - start;
+
+		buddy_arena_stats(arena, &stats);
+		printf("purge: %-8s spike %3zu MiB, after %3zu MiB, %4zu MiB purged, %6.1f us per hot cycle\n",
+		       modes[mode], spike >> 20, (rss_bytes() - base) >> 20,
+		       stats.purged_bytes >> 20, elapsed / hot / 1e3);
+		buddy_arena_destroy(arena);
+	}
+}
+
+/**
+ * A 64G arena of 4K pages over a reserved mapping: creation, 1G blocks filling
+ * it, the largest blocks, and a random mix of 4K to 256M blocks. Only the
+ * first byte of each block is touched, so little of the region is backed.
+ */
+static void bench_large(void)
+{
+	enum { ORDER = 36, ITERS = 1000000, WORKING_SET = 256 };
+	static void *blocks[1 << (ORDER - 30)];
+	static void *set[WORKING_SET];
+
+	double start = now_ns();
+	buddy_arena_t *arena = buddy_arena_create(NULL, 1UL << ORDER, 12, ORDER, 0);
+	double elapsed = now_ns() - start;
+
+	assert(arena != NULL);
+	printf("large: create 64G arena of 4K pages: %6.1f ms\n", elapsed / 1e6);
+
+	int nblocks = 1 << (ORDER - 30);
+
+	start = now_ns();
+	for (int i = 0; i < nblocks; i++) {
+		blocks[i] = buddy_arena_alloc(arena, 1UL << 30);
+		assert(blocks[i] != NULL);
+		*(char *)blocks[i] = i;
+	}
+	elapsed = now_ns() - start;
+
+	void *past = buddy_arena_alloc(arena, 4096);
+
+	assert(past == NULL);
+	(void)past;
+	for (int i = 0; i < nblocks; i++)
+		buddy_arena_free(arena, blocks[i]);
+	printf("large: %d x 1G blocks fill the arena: %6.1f us per alloc\n", nblocks,
+	       elapsed / nblocks / 1e3);
+
+	void *half = buddy_arena_alloc(arena, 32UL << 30);
+	void *quarter = buddy_arena_alloc(arena, 16UL << 30);
+
+	void *last = buddy_arena_alloc(arena, 16UL << 30);
+
+	past = buddy_arena_alloc(arena, 16UL << 30);
+	assert(half != NULL && quarter != NULL && last != NULL);
+	assert(past == NULL);
+	printf("large: 32G + 2 x 16G blocks: %p %p %p\n", half, quarter, last);
+	buddy_arena_reset(arena);
+
+	unsigned seed = 1;
+
+	memset(set, 0, sizeof(set));
+	start = now_ns();
+	for (int i = 0; i < ITERS; i++) {
+		int slot = rand_r(&seed) % WORKING_SET;
+
+		if (set[slot])
+			buddy_arena_free(arena, set[slot]);
+		set[slot] = buddy_arena_alloc(arena, 4096UL << (rand_r(&seed) % 17));
+		assert(set[slot] != NULL);
+		*(char *)set[slot] = 1;
+	}
+	elapsed = now_ns() - start;
+	printf("large: random 4K-256M blocks: %6.1f ns per free+alloc\n", elapsed / ITERS);
+
+	buddy_arena_destroy(arena);
+}
+
+/**
+ * Page descriptor footprint and the hot paths that touch it
+ *
+ * Reports the bookkeeping bytes per GiB of 4K pages, with and without the
+ * lock-free stack's links, then times random free+alloc of 4K to 64K blocks
+ * over a 1G arena whose working set spreads the descriptors touched across
+ * all of it. Build with -DUSE_COMPACT=1 to compare the compact layout.
+ */
+static void bench_meta(void)
+{
+	enum { ORDER = 30, ITERS = 2000000, WORKING_SET = 16384 };
+	static void *set[WORKING_SET];
+	static const unsigned flags[] = { 0, BUDDY_LOCKFREE };
+	static const char *names[] = { "plain", "lockfree" };
+	buddy_stats_t stats;
+
+	for (int f = 0; f < 2; f++) {
+		buddy_arena_t *arena = buddy_arena_create(NULL, 1UL << ORDER, 12, ORDER, flags[f]);
+
+		assert(arena != NULL);
+		buddy_arena_stats(arena, &stats);
+		printf("meta: %-8s metadata per GiB of 4K pages: %9zu bytes (%5.2f per page)\n",
+		       names[f], stats.meta_bytes, (double)stats.meta_bytes / (1 << (ORDER - 12)));
+		buddy_arena_destroy(arena);
+	}
+
+	buddy_arena_t *arena = buddy_arena_create(NULL, 1UL << ORDER, 12, ORDER, 0);
+	unsigned seed = 1;
+
+	assert(arena != NULL);
+	memset(set, 0, sizeof(set));
+	double start = now_ns();
+	for (int i = 0; i < ITERS; i++) {
+		int slot = rand_r(&seed) % WORKING_SET;
+
+		if (set[slot])
+			buddy_arena_free(arena, set[slot]);
+		set[slot] = buddy_arena_alloc(arena, 4096UL << (rand_r(&seed) % 5));
+		assert(set[slot] != NULL);
+	}
+	double elapsed = now_ns() - start;
+
+	printf("meta: random 4K-64K blocks, %d live: %6.1f ns per free+alloc\n", WORKING_SET,
+	       elapsed / ITERS);
+	buddy_arena_destroy(arena);
+}
+
+/**
+ * Handing out a block and writing its first cache line
+ *
+ * Random free+alloc of 4K to 64K blocks over a 1G arena, as in bench_meta,
+ * with the caller writing the first 64 bytes of each block it gets. Free-list
+ * links kept inside the free blocks (-DUSE_INTRUSIVE=1) leave that line in
+ * the cache when the block is handed out.
+ */
+static void bench_touch(void)
+{
+	enum { ORDER = 30, ITERS = 2000000, WORKING_SET = 16384 };
+	static void *set[WORKING_SET];
+	buddy_arena_t *arena = buddy_arena_create(NULL, 1UL << ORDER, 12, ORDER, 0);
+	buddy_stats_t stats;
+	unsigned seed = 1;
+
+	assert(arena != NULL);
+	memset(set, 0, sizeof(set));
+
+	// The first pass faults in the pages whose lines get written
+	double start = 0;
+	for (int i = 0; i < 2 * ITERS; i++) {
+		int slot = rand_r(&seed) % WORKING_SET;
+
+		if (i == ITERS)
+			start = now_ns();
+		if (set[slot])
+			buddy_arena_free(arena, set[slot]);
+		set[slot] = buddy_arena_alloc(arena, 4096UL << (rand_r(&seed) % 5));
+		assert(set[slot] != NULL);
+		memset(set[slot], i, 64);
+	}
+	double elapsed = now_ns() - start;
+
+	buddy_arena_stats(arena, &stats);
+	printf("touch: random 4K-64K blocks, %d live: %6.1f ns per free+alloc+write, "
+	       "%zu bytes of metadata\n", WORKING_SET, elapsed / ITERS, stats.meta_bytes);
+	buddy_arena_destroy(arena);
+}
+
+/**
+ * Startup cost against arena size
+ *
+ * Creates arenas of 4K pages from 1G to 256G over reserved mappings and times
+ * the creation and the first 4K allocation, which splits the whole arena
+ * down to one page. The resident growth is the metadata actually touched.
+ */
+static void bench_init(void)
+{
+	static const int orders[] = { 30, 32, 34, 36, 38 };
+
+	for (size_t i = 0; i < sizeof(orders) / sizeof(orders[0]); i++) {
+		int order = orders[i];
+		size_t rss = rss_bytes();
+		double start = now_ns();
+		buddy_arena_t *arena = buddy_arena_create(NULL, 1UL << order, 12, order, 0);
+		double created = now_ns();
+
+		if (arena == NULL) {
+			printf("init: %4luG arena: cannot create\n", 1UL << (order - 30));
+			continue;
+		}
+
+		void *block = buddy_arena_alloc(arena, 4096);
+		double allocated = now_ns();
+
+		assert(block != NULL);
+		printf("init: %4luG arena: create %9.1f us, first alloc %6.1f us, %8zu KiB resident\n",
+		       1UL << (order - 30), (created - start) / 1e3, (allocated - created) / 1e3,
+		       (rss_bytes() - rss) >> 10);
+		buddy_arena_destroy(arena);
+	}
+}
+
+/**
+ * A heap following its working set
+ *
+ * A heap of 4M chunks grows to a 256M peak of 64K blocks, then frees all but
+ * every eighth block, then the rest, and settles at a 32M working set. Prints the chunks mapped and resident memory at each
+ * stage, and the cost of alloc and free with the chunk lookup. Every block
+ * is written, so its memory is resident.
+ *
+ * Then, in a heap of 4096 chunk slots as libbuddy.so uses, 1000 chunk-sized
+ * blocks are allocated while a small block holds the first chunk, so every
+ * alloc finds all mapped chunks full and maps another.
+ */
+static void bench_heap(void)
+{
+	enum { CHUNK = 22, BLOCK = 64 << 10, NBLOCKS = 4096 };
+	static void *blocks[NBLOCKS];
+	size_t rss = rss_bytes();
+	buddy_heap_t *heap = buddy_heap_create(12, CHUNK, 1024, 0);
+
+	assert(heap != NULL);
+
+	double start = now_ns();
+	for (int i = 0; i < NBLOCKS; i++) {
+		blocks[i] = buddy_heap_alloc(heap, BLOCK);
+		assert(blocks[i] != NULL);
+	}
+	double elapsed = now_ns() - start;
+
+	for (int i = 0; i < NBLOCKS; i++)
+		memset(blocks[i], 1, BLOCK);
+	printf("heap: peak   %4d chunks, %4zu MiB resident, %6.1f ns per alloc\n",
+	       buddy_heap_chunks(heap), (rss_bytes() - rss) >> 20, elapsed / NBLOCKS);
+
+	start = now_ns();
+	for (int i = 0; i < NBLOCKS; i++)
+		if (i % 8 != 0)
+			buddy_heap_free(heap, blocks[i]);
+	elapsed = now_ns() - start;
+
+	printf("heap: sparse %4d chunks, %4zu MiB resident, %6.1f ns per free\n",
+	       buddy_heap_chunks(heap), (rss_bytes() - rss) >> 20, elapsed / (NBLOCKS / 8 * 7));
+
+	for (int i = 0; i < NBLOCKS; i += 8)
+		buddy_heap_free(heap, blocks[i]);
+	for (int i = 0; i < NBLOCKS / 8; i++) {
+		blocks[i] = buddy_heap_alloc(heap, BLOCK);
+		assert(blocks[i] != NULL);
+		memset(blocks[i], 1, BLOCK);
+	}
+
+	printf("heap: steady %4d chunks, %4zu MiB resident\n",
+	       buddy_heap_chunks(heap), (rss_bytes() - rss) >> 20);
+	buddy_heap_destroy(heap);
+
+	enum { GROWS = 1000 };
+
+	heap = buddy_heap_create(12, CHUNK, 4096, 0);
+	assert(heap != NULL);
+
+	void *pin = buddy_heap_alloc(heap, 1);
+
+	assert(pin != NULL);
+	(void)pin;
+
+	start = now_ns();
+	for (int i = 0; i < GROWS; i++) {
+		blocks[i] = buddy_heap_alloc(heap, 1 << CHUNK);
+		assert(blocks[i] != NULL);
+	}
+	elapsed = now_ns() - start;
+
+	printf("heap: grow   %4d chunks of 4096 slots,      %6.1f us per alloc\n",
+	       buddy_heap_chunks(heap), elapsed / GROWS / 1e3);
+	buddy_heap_destroy(heap);
+}
+
+/**
+ * A 3.5G region, against rounding it up to a 4G arena
+ *
+ * Both are carved into 64M blocks until they run out. The 3.5G arena is
+ * seeded with 2G, 1G and 512M blocks; it maps and describes only the memory
+ * it was given.
+ */
+static void bench_npot(void)
+{
+	enum { BLOCK = 26 };
+	static const size_t sizes[] = { 7UL << 29, 1UL << 32 };
+	buddy_stats_t stats;
+
+	for (int i = 0; i < 2; i++) {
+		buddy_arena_t *arena = buddy_arena_create(NULL, sizes[i], 12, 32, 0);
+		int n = 0;
+
+		assert(arena != NULL);
+		buddy_arena_stats(arena, &stats);
+
+		double start = now_ns();
+		while (buddy_arena_alloc(arena, 1UL << BLOCK) != NULL)
+			n++;
+		double elapsed = now_ns() - start;
+
+		printf("npot: %4zuM region: %2d x 64M blocks, %7zu KiB metadata, %6.1f ns per alloc\n",
+		       sizes[i] >> 20, n, stats.meta_bytes >> 10, elapsed / n);
+		buddy_arena_destroy(arena);
+	}
+}
+
+/**
+ * The order search buddy_size_order() replaced: one order at a time upward
+ * from min_order
+ */
+static int loop_order(size_t size, int min_order, int max_order)
+{
+	int order = min_order;
+
+	while ((1UL << order) < size && order <= max_order)
+		order++;
+	return order;
+}
+
+/**
+ * Size-to-order mapping across 1 B to 1 GiB
+ *
+ * Times the order loop, buddy_size_order() and buddy_arena_size_class() on
+ * a 1G slab arena of 4K pages, over random sizes spread evenly across the
+ * orders of each range.
+ */
+static void bench_order(void)
+{
+	enum { NSIZES = 4096, ITERS = 2000 };
+	static const struct { int lo, hi; const char *name; } ranges[] = {
+		{ 0, 11, "1B - 2K" }, { 12, 20, "2K - 1M" }, { 21, 30, "1M - 1G" }, { 0, 30, "1B - 1G" }
+	};
+	static size_t sizes[NSIZES];
+	buddy_arena_t *arena = buddy_arena_create(NULL, 1UL << 30, 12, 30, BUDDY_SLAB);
+	buddy_class_t cls;
+	unsigned seed = 1;
+
+	assert(arena != NULL);
+
+	for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+		int lo = ranges[r].lo, hi = ranges[r].hi;
+		long sum[3] = { 0, 0, 0 };
+		double ns[3];
+
+		// A size of order o is in (1 << (o - 1), 1 << o]
+		for (int i = 0; i < NSIZES; i++) {
+			seed = seed * 1103515245 + 12345;
+
+			int order = lo + (seed >> 8) % (hi - lo + 1);
+			size_t below = order > 0 ? 1UL << (order - 1) : 0;
+
+			sizes[i] = below + 1 + ((size_t)seed << 4) % ((1UL << order) - below);
+		}
+
+		double start = now_ns();
+		for (int k = 0; k < ITERS; k++)
+			for (int i = 0; i < NSIZES; i++)
+				sum[0] += loop_order(sizes[i], 12, 30);
+		ns[0] = now_ns() - start;
+
+		start = now_ns();
+		for (int k = 0; k < ITERS; k++)
+			for (int i = 0; i < NSIZES; i++)
+				sum[1] += buddy_size_order(sizes[i], 12);
+		ns[1] = now_ns() - start;
+
+		start = now_ns();
+		for (int k = 0; k < ITERS; k++) {
+			for (int i = 0; i < NSIZES; i++) {
+				buddy_arena_size_class(arena, sizes[i], &cls);
+				sum[2] += cls.usable;
+			}
+		}
+		ns[2] = now_ns() - start;
+
+		assert(sum[0] == sum[1] && sum[2] > 0);
+		printf("order: %s: loop %5.2f ns, clz %5.2f ns, size class %5.2f ns per size\n",
+		       ranges[r].name, ns[0] / ITERS / NSIZES, ns[1] / ITERS / NSIZES,
+		       ns[2] / ITERS / NSIZES);
+	}
+	buddy_arena_destroy(arena);
+}
+
+static const bench_t benches[] = {
+	{ "free", bench_free },
+	{ "scale", bench_scale },
+	{ "pcp", bench_pcp },
+	{ "lockfree", bench_lockfree },
+	{ "slab", bench_slab },
+	{ "bulk", bench_bulk },
+	{ "free_bulk", bench_free_bulk },
+	{ "lazy", bench_lazy },
+	{ "realloc", bench_realloc },
+	{ "exact", bench_exact },
+	{ "hugepage", bench_hugepage },
+	{ "purge", bench_purge },
+	{ "large", bench_large },
+	{ "meta", bench_meta },
+	{ "touch", bench_touch },
+	{ "init", bench_init },
+	{ "heap", bench_heap },
+	{ "npot", bench_npot },
+	{ "order", bench_order },
+};
+
+int main(int argc, char **argv)
+{
+	size_t nbenches = sizeof(benches) / sizeof(benches[0]);
+
+	for (size_t i = 0; i < nbenches; i++) {
+		int selected = (argc == 1);
+
+		for (int a = 1; a < argc; a++)
+			if (strcmp(argv[a], benches[i].name) == 0)
+				selected = 1;
+
+		if (selected)
+			benches[i].run();
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+/**
+ * Container Benchmarks
+ *
+ * Times standard containers allocating from a buddy arena, through
+ * BuddyResource and BuddyAllocator, against the default new/delete resource.
+ * Each line gives the time per element operation. The last lines time the
+ * compile-time BuddyArena against a runtime arena of the same orders.
+ */
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include "buddy.hpp"
+
+namespace {
+
+enum { ELEMS = 1000000, ROUNDS = 5 };
+
+/**
+ * Read the monotonic clock
+ *
+ * @return Current time in nanoseconds
+ */
+double now_ns()
+{
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Grow vectors one push_back at a time, so every doubling reallocates
+ */
+template <class Vector, class Make>
+double vector_push(Make make)
+{
+    double start = now_ns();
+
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int v = 0; v < 100; v++) {
+            Vector vec = make();
+
+            for (int i = 0; i < ELEMS / 100; i++)
+                vec.push_back(i);
+        }
+    }
+
+    return (now_ns() - start) / ROUNDS / ELEMS;
+}
+
+/**
+ * Insert keys into a hash map and erase them again: one node each, plus the
+ * bucket arrays as it rehashes
+ */
+template <class Map, class Make>
+double map_churn(Make make)
+{
+    double start = now_ns();
+
+    for (int r = 0; r < ROUNDS; r++) {
+        Map map = make();
+        unsigned seed = r + 1;
+
+        for (int i = 0; i < ELEMS; i++) {
+            seed = seed * 1103515245 + 12345;
+            map[seed] = i;
+        }
+        assert(map.size() > 0);
+        map.clear();
+    }
+
+    return (now_ns() - start) / ROUNDS / ELEMS;
+}
+
+/**
+ * Append to a list and pop from its front, keeping a thousand nodes live
+ */
+template <class List, class Make>
+double list_queue(Make make)
+{
+    double start = now_ns();
+
+    for (int r = 0; r < ROUNDS; r++) {
+        List list = make();
+
+        for (int i = 0; i < ELEMS; i++) {
+            list.push_back(i);
+            if (i >= 1000)
+                list.pop_front();
+        }
+    }
+
+    return (now_ns() - start) / ROUNDS / ELEMS;
+}
+
+/**
+ * Replace random blocks among a thousand live ones, each of a random order
+ * from min_order to max_order, writing the first byte of each as a caller
+ * would
+ *
+ * @return nanoseconds per allocation and free
+ */
+template <class Alloc, class Free>
+double block_churn(int min_order, int max_order, Alloc alloc, Free release)
+{
+    void *live[1000] = {};
+    unsigned seed = 1;
+    double start = now_ns();
+
+    for (int i = 0; i < ROUNDS * ELEMS; i++) {
+        seed = seed * 1103515245 + 12345;
+
+        int k = (seed >> 8) % 1000;
+        int order = min_order + (seed >> 20) % (max_order - min_order + 1);
+
+        release(live[k]);
+        live[k] = alloc((std::size_t(1) << order) - (seed & 63));
+        assert(live[k] != nullptr);
+        *static_cast<char *>(live[k]) = 1;
+    }
+
+    double ns = (now_ns() - start) / ROUNDS / ELEMS;
+
+    for (void *p : live)
+        release(p);
+    return ns;
+}
+
+void report(const char *what, double def, double buddy)
+{
+    std::printf("pmr: %-28s new/delete %6.1f ns, buddy %6.1f ns\n", what, def, buddy);
+}
+
+void report_arena(const char *what, double runtime, double fixed)
+{
+    std::printf("arena: %-26s runtime %6.1f ns, template %6.1f ns\n", what, runtime, fixed);
+}
+
+} // namespace
+
+int main()
+{
+    BuddyResource buddy(1UL << 30, 12, 30);
+    std::pmr::memory_resource *def = std::pmr::new_delete_resource();
+
+    report("pmr::vector<int> push_back",
+           vector_push<std::pmr::vector<int>>([&] { return std::pmr::vector<int>(def); }),
+           vector_push<std::pmr::vector<int>>([&] { return std::pmr::vector<int>(&buddy); }));
+
+    report("pmr::unordered_map<u32,int>",
+           map_churn<std::pmr::unordered_map<unsigned, int>>(
+               [&] { return std::pmr::unordered_map<unsigned, int>(def); }),
+           map_churn<std::pmr::unordered_map<unsigned, int>>(
+               [&] { return std::pmr::unordered_map<unsigned, int>(&buddy); }));
+
+    report("pmr::list<int> queue",
+           list_queue<std::pmr::list<int>>([&] { return std::pmr::list<int>(def); }),
+           list_queue<std::pmr::list<int>>([&] { return std::pmr::list<int>(&buddy); }));
+
+    using Vector = std::vector<int, BuddyAllocator<int>>;
+    using Map = std::unordered_map<unsigned, int, std::hash<unsigned>, std::equal_to<unsigned>,
+                                   BuddyAllocator<std::pair<const unsigned, int>>>;
+
+    report("vector<int> push_back",
+           vector_push<std::vector<int>>([] { return std::vector<int>(); }),
+           vector_push<Vector>([&] { return Vector(BuddyAllocator<int>(&buddy)); }));
+
+    report("unordered_map<u32,int>",
+           map_churn<std::unordered_map<unsigned, int>>(
+               [] { return std::unordered_map<unsigned, int>(); }),
+           map_churn<Map>([&] {
+               return Map(0, std::hash<unsigned>(), std::equal_to<unsigned>(),
+                          BuddyAllocator<std::pair<const unsigned, int>>(&buddy));
+           }));
+
+    buddy_stats_t stats;
+
+    buddy_arena_drain(buddy.arena());
+    buddy_arena_stats(buddy.arena(), &stats);
+    assert(stats.free_bytes == 1UL << 30);
+
+    // Both arenas without slabs, so every request runs the buddy path
+    buddy_arena_t *runtime = buddy_arena_create(nullptr, 1UL << 30, 12, 30, 0);
+    auto fixed = std::make_unique<BuddyArena<12, 30>>();
+
+    assert(runtime != nullptr);
+
+    const int spans[][2] = {{12, 12}, {12, 16}, {12, 20}};
+
+    for (auto &span : spans) {
+        char what[32];
+
+        std::snprintf(what, sizeof(what), "orders %d-%d churn", span[0], span[1]);
+        report_arena(what,
+                     block_churn(span[0], span[1],
+                                 [&](std::size_t n) { return buddy_arena_alloc(runtime, n); },
+                                 [&](void *p) { if (p != nullptr) buddy_arena_free(runtime, p); }),
+                     block_churn(span[0], span[1],
+                                 [&](std::size_t n) { return fixed->alloc(n); },
+                                 [&](void *p) { fixed->free(p); }));
+    }
+
+    assert(fixed->free_bytes() == 1UL << 30);
+    buddy_arena_destroy(runtime);
+
+    return 0;
+}
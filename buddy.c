@@ -9,35 +9,104 @@
  **************************************************************************/
 #define USE_DEBUG 0
 
+/* free-area engine: 0 keeps list.h free lists, 1 keeps one bitmap per order */
+#ifndef USE_BITMAP
+#  define USE_BITMAP 0
+#endif
+
+/* page descriptors: 0 keeps one page_t per page, 1 keeps parallel arrays of
+ * 16-bit states and 32-bit free-list links */
+#ifndef USE_COMPACT
+#  define USE_COMPACT 0
+#endif
+
+/* free-list links of the list engine: 0 keeps them with the page descriptors,
+ * 1 keeps them in the first bytes of each free block and implies USE_COMPACT */
+#ifndef USE_INTRUSIVE
+#  define USE_INTRUSIVE 0
+#endif
+
+#if USE_INTRUSIVE == 1
+#  if USE_BITMAP == 1
+#    error "USE_INTRUSIVE needs the list engine"
+#  endif
+#  undef USE_COMPACT
+#  define USE_COMPACT 1
+#endif
+
 /**************************************************************************
  * Included Files
  **************************************************************************/
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "buddy.h"
 #include "list.h"
+#include "slab.h"
 
 /**************************************************************************
  * Public Definitions
  **************************************************************************/
+/* orders of the default arena used by buddy_init() and friends */
 #define MIN_ORDER 12
 #define MAX_ORDER 20
 
-#define MEMORY_AREA (1 << MAX_ORDER)
+/* chunks of 1 << MAX_ORDER bytes the default heap may grow to */
+#define HEAP_CHUNKS 1024
+
+#define MEMORY_AREA (1UL << MAX_ORDER)
 #define PAGE_SIZE (1<<MIN_ORDER)
 
 #define PAGE_NUM (MEMORY_AREA/PAGE_SIZE)
 
 /* page index to address */
-#define PAGE_TO_ADDR(page_idx) (void *)((page_idx*PAGE_SIZE) + g_memory)
+#define PAGE_TO_ADDR(a, page_idx) (void *)((a)->memory + ((unsigned long)(page_idx) << (a)->min_order))
 
 /* address to page index */
-#define ADDR_TO_PAGE(addr) ((unsigned long)((void *)addr - (void *)g_memory) / PAGE_SIZE)
+#define ADDR_TO_PAGE(a, addr) ((unsigned long)((char *)(addr) - (a)->memory) >> (a)->min_order)
 
 /* find buddy address */
-#define BUDDY_ADDR(addr, o) (void *)((((unsigned long)addr - (unsigned long)g_memory) ^ (1<<o)) \
-									 + (unsigned long)g_memory)
+#define BUDDY_ADDR(a, addr, o) (void *)((((unsigned long)(addr) - (unsigned long)(a)->memory) ^ (1UL<<(o))) \
+									 + (unsigned long)(a)->memory)
+
+/* size of a transparent huge page, the alignment of mapped regions */
+#define HUGE_PAGE (2UL << 20)
+
+/* size of a cache line, so lock words do not share one */
+#define CACHE_LINE 64
+
+/* page state of a page that does not head a block: zero, so metadata fresh
+ * from the kernel needs no initialization (every order is at least 1) */
+#define PAGE_NONE 0
+
+/* flag in the page state of a page heading a free block */
+#define PAGE_FREE 0x100
+
+/* flag in the page state of every page of a slab block */
+#define PAGE_SLAB 0x200
+
+/* flag in the page state of a block being freed by buddy_arena_free_bulk() */
+#define PAGE_BATCH 0x400
+
+/* flag in the page state of a piece of an exact-size block with more pieces after it */
+#define PAGE_MORE 0x800
+
+/* order of the block in a page state */
+#define PAGE_ORDER(state) ((state) & 0xff)
+
+/* number of orders, from min_order up, that have per-CPU caches */
+#define PCP_ORDERS 3
+
+/* find the page index of the buddy of the order o block at page index */
+#define BUDDY_PAGE(a, page_idx, o) ((page_idx) ^ (1 << ((o) - (a)->min_order)))
 
 #if USE_DEBUG == 1
 #  define PDEBUG(fmt, ...) \
@@ -52,24 +121,167 @@
 /**************************************************************************
  * Public Types
  **************************************************************************/
+#if USE_COMPACT == 0
 typedef struct {
 	struct list_head list;
-    int block_size;
-    int page_index;
-    void *block_address;
+    int state;          // order of the block headed by this page | PAGE_FREE, or PAGE_NONE
+    unsigned stack_next;    // next block on the lock-free stack, as page index + 1
 } page_t;
+#endif
+
+/* bits in a bitmap word */
+#define BITS_PER_WORD (8 * (int)sizeof(unsigned long))
+
+/* words needed for n bits */
+#define BITMAP_WORDS(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+#if USE_BITMAP == 1
+/* number of blocks of order o */
+#define ORDER_BLOCKS(a, o) ((a)->page_num >> ((o) - (a)->min_order))
+
+/**
+ * Free blocks of one order, one bit per block. A second level keeps one bit
+ * per non-zero word so a free block is found with two count-trailing-zeros.
+ */
+typedef struct {
+    pthread_mutex_t lock;       // guards this order in concurrent arenas
+    unsigned long *bits;        // bit i set if block i of this order is free
+    unsigned long *summary;     // bit w set if bits[w] is non-zero
+    int nsummary;               // words in summary
+    int hint;                   // summary words below this one are all zero
+    int nfree;                  // bits set in bits
+    unsigned long nsplit;       // blocks split off a larger block into this order
+    unsigned long nmerge;       // buddy pairs of this order merged into the next
+} __attribute__((aligned(CACHE_LINE))) free_area_t;
+#else
+/**
+ * Free blocks of one order, linked through their page structures
+ */
+typedef struct {
+    pthread_mutex_t lock;       // guards this order in concurrent arenas
+#if USE_COMPACT == 1
+    unsigned head;              // first block on the list, as page index + 1, 0 if empty
+#else
+    struct list_head list;
+#endif
+    int nfree;                  // blocks on list
+    unsigned long nsplit;       // blocks split off a larger block into this order
+    unsigned long nmerge;       // buddy pairs of this order merged into the next
+} __attribute__((aligned(CACHE_LINE))) free_area_t;
+#endif
+
+/**
+ * A per-CPU cache of ready-made blocks of the lowest PCP_ORDERS orders.
+ *
+ * Cached blocks are allocated as far as the free areas are concerned, so
+ * taking one or putting one back never splits, merges or takes an order lock.
+ * A thread that finds the cache of its CPU busy goes to the free areas.
+ */
+typedef struct {
+    int busy;                       // 1 while a thread is using the cache
+    int count[PCP_ORDERS];          // blocks cached of each order
+    int *blocks[PCP_ORDERS];        // page indices of the cached blocks, a stack
+} __attribute__((aligned(CACHE_LINE))) pcp_t;
+
+/**
+ * An arena: a region of memory and the buddy state that manages it.
+ *
+ * The page structures and free areas are allocated together with the arena
+ * and are sized by the runtime orders it was created with.
+ *
+ * In a BUDDY_CONCURRENT arena each order has its own lock. The free blocks of
+ * an order, and the page state saying a block is free at that order, only
+ * change under that order's lock, so split and merge take one lock at a time.
+ *
+ * In a BUDDY_LOCKFREE arena freed min_order blocks go on a Treiber stack
+ * instead. They are not coalesced until memory runs out.
+ */
+struct buddy_arena {
+    char *memory;               // start of the managed region
+    int min_order;              // order of a page
+    int max_order;              // order of the whole region
+    int page_num;               // pages in the region
+    unsigned flags;             // BUDDY_* flags given to buddy_arena_create()
+#if USE_COMPACT == 1
+    short *page_states;         // per page: the state page_t would hold
+    unsigned *page_next;        // per page: next block on its free list, as page index + 1;
+                                // NULL when the links live in the free blocks
+    unsigned *page_prev;        // per page: previous block on its free list, likewise
+    unsigned *stack_next;       // per page: next block on the lock-free stack, as page
+                                // index + 1; NULL without BUDDY_LOCKFREE
+#else
+    page_t *pages;              // page structures, one per page
+#endif
+    free_area_t *free_area;     // free blocks, indexed by order
+    size_t meta_bytes;          // bytes allocated for the arena, free areas and pages
+#if USE_BITMAP == 1
+    unsigned long *bitmap_words;    // backing store for every order's bits
+    unsigned long *summary_words;   // backing store for every order's summary
+#endif
+    pcp_t *pcp;                 // per-CPU caches, NULL when disabled
+    int pcp_slots;              // number of per-CPU caches
+    int pcp_low;                // blocks left in a cache after a drain
+    int pcp_high;               // blocks a cache may hold before it is drained
+    int pcp_batch;              // blocks taken from the free areas on a refill
+    slab_cache_t *slabs;        // size classes for small requests, NULL without BUDDY_SLAB
+    size_t mapped;              // bytes of the region mapped by the arena, 0 if the caller's
+    unsigned *purge_stamps;     // per 1 << purge_order chunk: clock when last dirtied, 0 if
+                                // purged; NULL when purging is off
+    int purge_order;            // order of a purge chunk, the smallest block purged
+    unsigned purge_decay;       // milliseconds a free chunk stays dirty before it is purged
+    int purge_advice;           // MADV_DONTNEED or MADV_FREE
+    unsigned long epoch;        // CLOCK_MONOTONIC_COARSE milliseconds when purging was set up
+    unsigned last_purge;        // clock of the last purge pass
+    unsigned long purged;       // bytes purged so far
+    int lazy_threshold;         // free blocks an order keeps uncoalesced, 0 to always merge
+    pthread_mutex_t batch_lock; // serializes bulk frees in concurrent arenas
+    
+    //Bit o set while order o has a free block. Written by the holder of any
+    //order's lock, so it has a cache line of its own rather than invalidating
+    //the fields above that every call reads.
+    unsigned long free_mask __attribute__((aligned(CACHE_LINE)));
+    
+    //Head of the lock-free stack: a generation tag in the upper 32 bits and
+    //the top block's page index + 1 in the lower 32, 0 when empty
+    unsigned long stack_head __attribute__((aligned(CACHE_LINE)));
+};
+
+/**
+ * A heap: arenas of one 1 << max_order chunk each, over a reserved range of
+ * address space. Chunk i lives at memory + (i << max_order), so the chunk
+ * owning an address is found with a shift.
+ *
+ * Chunk 0 always exists. Others are added when no chunk has room and
+ * released, memory and arena, when all of their memory is free again. An
+ * allocation only tries the chunks whose room bit is set: a chunk that fails
+ * one with nothing left on its free areas loses the bit until a block of it
+ * is freed. One
+ * free chunk is kept as a spare so a heap hovering at a chunk boundary does
+ * not map and unmap on every call.
+ *
+ * In a BUDDY_CONCURRENT heap, allocating and freeing hold the lock shared;
+ * adding and releasing chunks hold it exclusively.
+ */
+struct buddy_heap {
+    char *memory;               // reserved range holding every chunk
+    int min_order;              // order of a page
+    int max_order;              // order of a chunk
+    int max_chunks;             // chunks the range holds
+    unsigned flags;             // BUDDY_* flags of every chunk's arena
+    int nchunks;                // chunks with an arena
+    int hint;                   // chunk that served the last allocation
+    int spare;                  // a free chunk being kept, -1 if none
+    pthread_rwlock_t lock;      // guards chunks in concurrent heaps
+    unsigned long *mapped;      // bit i set while chunk i has an arena, after chunks[]
+    unsigned long *room;        // bit i set while chunk i is mapped and not known to be full
+    buddy_arena_t *chunks[];    // arena of each chunk, NULL while unmapped
+};
 
 /**************************************************************************
  * Global Variables
  **************************************************************************/
-/* free lists*/
-struct list_head free_area[MAX_ORDER+1];
-
-/* memory area */
-char g_memory[1<<MAX_ORDER];
-
-/* page structures */
-page_t g_pages[(1<<MAX_ORDER)/PAGE_SIZE];
+/* the heap behind buddy_init(), buddy_alloc(), buddy_free() and buddy_dump() */
+buddy_heap_t *g_heap;
 
 /**************************************************************************
  * Public Function Prototypes
@@ -80,246 +292,3051 @@ page_t g_pages[(1<<MAX_ORDER)/PAGE_SIZE];
  **************************************************************************/
 
 /**
- * Initialize the buddy system
+ * Read the state of a page
+ *
+ * Page states are read and written whole and atomically: a concurrent arena
+ * checks a buddy's state under the lock of one order while other orders may
+ * be updating it.
  */
-void buddy_init()
+static inline int page_state(buddy_arena_t *a, int index)
 {
-	int i;
-	int n_pages = (1<<MAX_ORDER) / PAGE_SIZE;
-	for (i = 0; i < n_pages; i++) {
-		/* TODO: INITIALIZE PAGE STRUCTURES */
-        INIT_LIST_HEAD(&g_pages[i].list);
-       
-        g_pages[i].block_size = -1;
-        g_pages[i].page_index = i;
-        g_pages[i].block_address = PAGE_TO_ADDR(i);
-      
-	}
+#if USE_COMPACT == 1
+    return __atomic_load_n(&a->page_states[index], __ATOMIC_RELAXED);
+#else
+    return __atomic_load_n(&a->pages[index].state, __ATOMIC_RELAXED);
+#endif
+}
 
-	/* initialize freelist */
-	for (i = MIN_ORDER; i <= MAX_ORDER; i++) {
-		INIT_LIST_HEAD(&free_area[i]);
-	}
+/**
+ * Set the state of a page
+ */
+static inline void set_page_state(buddy_arena_t *a, int index, int state)
+{
+#if USE_COMPACT == 1
+    __atomic_store_n(&a->page_states[index], (short)state, __ATOMIC_RELAXED);
+#else
+    __atomic_store_n(&a->pages[index].state, state, __ATOMIC_RELAXED);
+#endif
+}
 
-	/* add the entire memory as a freeblock */
-	list_add(&g_pages[0].list, &free_area[MAX_ORDER]);
-    
-    g_pages[0].block_size = MAX_ORDER;
+/**
+ * Link of a page to the next block on the lock-free stack
+ */
+static inline unsigned *stack_link(buddy_arena_t *a, int index)
+{
+#if USE_COMPACT == 1
+    return &a->stack_next[index];
+#else
+    return &a->pages[index].stack_next;
+#endif
 }
 
 /**
- * Ceiling function that will find the exponent needed to calculate the size of
- * of smallest block needed for a memory allocation.
- *
+ * Note that order has a free block. Called with the order's lock held.
  */
+static inline void mask_set(buddy_arena_t *a, int order)
+{
+    if(!(__atomic_load_n(&a->free_mask, __ATOMIC_RELAXED) & (1UL << order)))
+    {
+        __atomic_fetch_or(&a->free_mask, 1UL << order, __ATOMIC_RELAXED);
+    }
+}
 
-int order_exp(int size)
+/**
+ * Note that order has run out of free blocks. Called with the order's lock held.
+ */
+static inline void mask_clear(buddy_arena_t *a, int order)
 {
-    int order_num = MIN_ORDER;
-    
-    while((1 << order_num) < size && order_num < MAX_ORDER)
+    __atomic_fetch_and(&a->free_mask, ~(1UL << order), __ATOMIC_RELAXED);
+}
+
+/**
+ * Lock the free blocks of order, if the arena is concurrent
+ */
+static inline void area_lock(buddy_arena_t *a, int order)
+{
+    if(a->flags & BUDDY_CONCURRENT)
     {
-        order_num++;
+        pthread_mutex_lock(&a->free_area[order].lock);
     }
-    
-    return order_num;
 }
 
-void split(int order, int targetOrder, int index)
+/**
+ * Unlock the free blocks of order, if the arena is concurrent
+ */
+static inline void area_unlock(buddy_arena_t *a, int order)
 {
-    
-    if(order == targetOrder)
+    if(a->flags & BUDDY_CONCURRENT)
     {
-        return;
+        pthread_mutex_unlock(&a->free_area[order].lock);
     }
-    
-    //Get our page structure from list
+}
 
-    page_t *cur_page = &g_pages[ADDR_TO_PAGE(BUDDY_ADDR(PAGE_TO_ADDR(index), (order - 1)))];
-    
-    //Add page to proper list
-    
-    list_add(&(cur_page->list), &free_area[order-1]);
-    
-    //Recursive call to keep splitting if necessary
+#if USE_BITMAP == 1
+/**
+ * Words of bitmap and summary storage needed by every order of an arena of
+ * page_num pages
+ */
+static void area_words(int min_order, int max_order, int page_num, size_t *nbits,
+                       size_t *nsummary)
+{
+    *nbits = 0;
+    *nsummary = 0;
     
-    split(order-1, targetOrder, index);
+    for(int o = min_order; o <= max_order; o++)
+    {
+        size_t nwords = BITMAP_WORDS((size_t)page_num >> (o - min_order));
     
+        *nbits += nwords;
+        *nsummary += BITMAP_WORDS(nwords);
+    }
 }
 
-void merge(int order, void *addr)
+/**
+ * Set up empty bitmaps for every order
+ */
+static void area_init(buddy_arena_t *a)
 {
-    if(order == MAX_ORDER)
-    {
-        return;
-    }
+    unsigned long *bits = a->bitmap_words;
+    unsigned long *summary = a->summary_words;
+    
+    a->free_mask = 0;
     
-    page_t *cur_page = &g_pages[ADDR_TO_PAGE(BUDDY_ADDR(addr, (order+1)))];
+    for(int o = a->min_order; o <= a->max_order; o++)
+    {
+        int nwords = BITMAP_WORDS(ORDER_BLOCKS(a, o));
     
-    list_del((&cur_page->list));
+        a->free_area[o].bits = bits;
+        a->free_area[o].summary = summary;
+        a->free_area[o].nsummary = BITMAP_WORDS(nwords);
+        a->free_area[o].hint = a->free_area[o].nsummary;
+        a->free_area[o].nfree = 0;
     
-    merge(order+1, addr);
+        bits += nwords;
+        summary += a->free_area[o].nsummary;
+    }
 }
+
 /**
- * Allocate a memory block.
- *
- * On a memory request, the allocator returns the head of a free-list of the
- * matching size (i.e., smallest block that satisfies the request). If the
- * free-list of the matching block size is empty, then a larger block size will
- * be selected. The selected (large) block is then splitted into two smaller
- * blocks. Among the two blocks, left block will be used for allocation or be
- * further splitted while the right block will be added to the appropriate
- * free-list.
- *
- * @param size size in bytes
- * @return memory block address
+ * Mark the block at page index as free at order
  */
-void *buddy_alloc(int size)
+static void area_add(buddy_arena_t *a, int order, int index)
 {
-	/* TODO: IMPLEMENT THIS FUNCTION */
-    
-    //Gets the correct order based on the size of the request
-    int order = order_exp(size);
+    free_area_t *area = &a->free_area[order];
+    int block = index >> (order - a->min_order);
+    int word = block / BITS_PER_WORD;
     
-    page_t *entry = NULL;
+    area->bits[word] |= 1UL << (block % BITS_PER_WORD);
+    area->summary[word / BITS_PER_WORD] |= 1UL << (word % BITS_PER_WORD);
     
-    //Iterate through the free lists to find a block
-    for(int i = order; i <= MAX_ORDER; i++)
+    if(word / BITS_PER_WORD < area->hint)
     {
-        
-        //If we have found a list with a free block of the proper size, return the entry.
-        if(!list_empty(&free_area[i]))
-        {
-
-            if(i == order)
-            {
-                //We found a block of proper size, so we can return it.
-                entry = list_entry(free_area[i].next, page_t, list);
-            
-                list_del(&(entry->list));
-            
-                return((entry->block_address));
-            }
-            else
-            {
-                //We found the next best solution - the next free block of a larger size
-        
-                entry = list_entry(free_area[i].next, page_t, list);
-                
-                //Get the index for our recursive function
-                
-                int cur_index = entry->page_index;
-                
-                list_del(&(entry->list));
-                
-                entry->block_size = order;
-                
-                //Call the recursive function to split even further
-            
-                split(i, order, cur_index);
-              
-                return (entry->block_address);
-            }
-        }
+        area->hint = word / BITS_PER_WORD;
     }
     
-    return NULL;
-   
+    area->nfree++;
+    mask_set(a, order);
+    set_page_state(a, index, order | PAGE_FREE);
 }
 
 /**
- * Free an allocated memory block.
- *
- * Whenever a block is freed, the allocator checks its buddy. If the buddy is
- * free as well, then the two buddies are combined to form a bigger block. This
- * process continues until one of the buddies is not free.
- *
- * @param addr memory block address to be freed
+ * Remove the free block at page index from order
  */
-void buddy_free(void *addr)
+static void area_del(buddy_arena_t *a, int order, int index)
 {
-	//Calculate the address of our buddy block
+    free_area_t *area = &a->free_area[order];
+    int block = index >> (order - a->min_order);
+    int word = block / BITS_PER_WORD;
     
-    int free_index = ADDR_TO_PAGE(addr);
+    area->bits[word] &= ~(1UL << (block % BITS_PER_WORD));
     
-    page_t *free_page = &g_pages[free_index];
+    if(area->bits[word] == 0)
+    {
+        area->summary[word / BITS_PER_WORD] &= ~(1UL << (word % BITS_PER_WORD));
+    }
     
-    int free_order = free_page->block_size;
+    if(--area->nfree == 0)
+    {
+        mask_clear(a, order);
+    }
     
-    page_t *buddy_block = NULL;
+    set_page_state(a, index, order);
+}
+
+/**
+ * Is the block at page index free at exactly this order?
+ */
+static int area_is_free(buddy_arena_t *a, int order, int index)
+{
+    int block = index >> (order - a->min_order);
     
-    //Just a list for handling and manipulating blocks while merging
+    //A buddy running past the end of the arena has no bit
     
-    struct list_head *temp_list;
+    if(block >= ORDER_BLOCKS(a, order))
+    {
+        return 0;
+    }
     
-    //Iterate through our lists
+    return (a->free_area[order].bits[block / BITS_PER_WORD] >> (block % BITS_PER_WORD)) & 1;
+}
+
+/**
+ * Take the lowest free block of order off the bitmap
+ *
+ * @return page index of the block, or -1 if there is none
+ */
+static int area_pop(buddy_arena_t *a, int order)
+{
+    free_area_t *area = &a->free_area[order];
     
-    for(int i = free_order; i <= MAX_ORDER; i++)
+    for(int s = area->hint; s < area->nsummary; s++)
     {
-        buddy_block = NULL;
-        
-        //Get our buddy block
-        
-        list_for_each(temp_list, &free_area[i])
-        {
-            buddy_block = list_entry(temp_list, page_t, list);
-            
-            if(buddy_block == NULL)
-            {
-                break;
-            }
-            else if(buddy_block->block_address == BUDDY_ADDR(addr, i))
-            {
-                break;
-            }
-        }
-        
-        if(buddy_block == NULL){
-            g_pages[free_index].block_size = -1;
-            list_add(&g_pages[free_index].list, &free_area[i]);
-            return;
-        }
-        else if(buddy_block->block_address != BUDDY_ADDR(addr, i))
-        {
-            g_pages[free_index].block_size = -1;
-            list_add(&g_pages[free_index].list, &free_area[i]);
-            return;
-        }
-        
-        if((char *) addr > buddy_block -> block_address)
+        if(area->summary[s] != 0)
         {
-            addr = buddy_block -> block_address;
-            free_index = ADDR_TO_PAGE(addr);
+            int word = s * BITS_PER_WORD + __builtin_ctzl(area->summary[s]);
+            int block = word * BITS_PER_WORD + __builtin_ctzl(area->bits[word]);
+            int index = block << (order - a->min_order);
+    
+            area->hint = s;
+            area_del(a, order, index);
+            return index;
         }
-        list_del(&(buddy_block->list));
     }
+    
+    area->hint = area->nsummary;
+    return -1;
 }
 
 /**
- * Print the buddy system status---order oriented
- *
- * print free pages in each order.
+ * Number of free blocks of order
  */
-void buddy_dump()
+static int area_count(buddy_arena_t *a, int order)
 {
-	int o;
-	for (o = MIN_ORDER; o <= MAX_ORDER; o++) {
-		struct list_head *pos;
-		int cnt = 0;
-		list_for_each(pos, &free_area[o]) {
-			cnt++;
-		}
-		printf("%d:%dK ", cnt, (1<<o)/1024);
+    return a->free_area[order].nfree;
+}
+#else
+#if USE_INTRUSIVE == 1
+/**
+ * Free-list links kept in the first bytes of a free block
+ */
+typedef struct {
+    unsigned next;      // next block on the list, as page index + 1, 0 at the end
+    unsigned prev;      // previous block on the list, likewise
+} free_link_t;
+#endif
+
+#if USE_COMPACT == 1
+/**
+ * Link from the free block at page index to the next block on its list
+ */
+static inline unsigned *link_next(buddy_arena_t *a, int index)
+{
+#if USE_INTRUSIVE == 1
+    return &((free_link_t *)PAGE_TO_ADDR(a, index))->next;
+#else
+    return &a->page_next[index];
+#endif
+}
+
+/**
+ * Link from the free block at page index to the previous block on its list
+ */
+static inline unsigned *link_prev(buddy_arena_t *a, int index)
+{
+#if USE_INTRUSIVE == 1
+    return &((free_link_t *)PAGE_TO_ADDR(a, index))->prev;
+#else
+    return &a->page_prev[index];
+#endif
+}
+#endif
+
+/**
+ * Words of bitmap storage needed by an arena: the list engine needs none
+ */
+static void area_words(int min_order, int max_order, int page_num, size_t *nbits,
+                       size_t *nsummary)
+{
+    (void)min_order;
+    (void)max_order;
+    (void)page_num;
+    *nbits = 0;
+    *nsummary = 0;
+}
+
+/**
+ * Set up empty free lists for every order
+ */
+static void area_init(buddy_arena_t *a)
+{
+	a->free_mask = 0;
+	for (int i = a->min_order; i <= a->max_order; i++) {
+#if USE_COMPACT == 1
+		a->free_area[i].head = 0;
+#else
+		INIT_LIST_HEAD(&a->free_area[i].list);
+#endif
+		a->free_area[i].nfree = 0;
 	}
-	printf("\n");
 }
 
-void printStats()
+/**
+ * Put the block at page index on the free list of order
+ */
+static void area_add(buddy_arena_t *a, int order, int index)
 {
-    printf("MIN ORDER: %d\n", MIN_ORDER);
-    printf("MAX ORDER: %d\n", MAX_ORDER);
-    printf("PAGE SIZE: %d\n", PAGE_SIZE);
-    printf("MEMORY AREA: %d\n", MEMORY_AREA);
-    printf("PAGE NUM: %d\n", PAGE_NUM);
+    set_page_state(a, index, order | PAGE_FREE);
+#if USE_COMPACT == 1
+    unsigned head = a->free_area[order].head;
+    
+    *link_next(a, index) = head;
+    *link_prev(a, index) = 0;
+    
+    if(head != 0)
+    {
+        *link_prev(a, head - 1) = index + 1;
+    }
+    
+    a->free_area[order].head = index + 1;
+#else
+    list_add(&a->pages[index].list, &a->free_area[order].list);
+#endif
+    a->free_area[order].nfree++;
+    mask_set(a, order);
+}
+
+/**
+ * Remove the free block at page index from the free list of order
+ */
+static void area_del(buddy_arena_t *a, int order, int index)
+{
+#if USE_COMPACT == 1
+    unsigned next = *link_next(a, index);
+    unsigned prev = *link_prev(a, index);
+    
+    if(prev != 0)
+    {
+        *link_next(a, prev - 1) = next;
+    }
+    else
+    {
+        a->free_area[order].head = next;
+    }
     
+    if(next != 0)
+    {
+        *link_prev(a, next - 1) = prev;
+    }
+#else
+    list_del(&a->pages[index].list);
+#endif
+    set_page_state(a, index, order);
+    
+    if(--a->free_area[order].nfree == 0)
+    {
+        mask_clear(a, order);
+    }
+}
+
+/**
+ * Is the block at page index free at exactly this order?
+ */
+static int area_is_free(buddy_arena_t *a, int order, int index)
+{
+    //A buddy past the end of the arena has no page; one that starts before
+    //the end but runs past it heads a smaller block
+    
+    return index < a->page_num && page_state(a, index) == (order | PAGE_FREE);
+}
+
+/**
+ * Take the head of the free list of order
+ *
+ * @return page index of the block, or -1 if the list is empty
+ */
+static int area_pop(buddy_arena_t *a, int order)
+{
+#if USE_COMPACT == 1
+    int index = (int)a->free_area[order].head - 1;
+    
+    if(index < 0)
+    {
+        return -1;
+    }
+    
+    area_del(a, order, index);
+    return index;
+#else
+    if(list_empty(&a->free_area[order].list))
+    {
+        return -1;
+    }
+    
+    page_t *entry = list_entry(a->free_area[order].list.next, page_t, list);
+    int index = entry - a->pages;
+    
+    area_del(a, order, index);
+    return index;
+#endif
+}
+
+/**
+ * Number of free blocks of order
+ */
+static int area_count(buddy_arena_t *a, int order)
+{
+    return a->free_area[order].nfree;
+}
+#endif
+
+/**
+ * Map an anonymous region for an arena, starting on a boundary of align bytes
+ * and at least a huge page, so every block of order 21 and up covers whole
+ * huge pages and blocks up to align bytes are aligned in memory as well as
+ * within the region. Only address space is spent on the alignment.
+ *
+ * With BUDDY_HUGEPAGE the region comes from MAP_HUGETLB when the system has
+ * huge pages reserved, and is otherwise marked MADV_HUGEPAGE for transparent
+ * huge pages.
+ *
+ * @param size bytes to map
+ * @param align alignment of the start, a power of two
+ * @param flags BUDDY_* flags of the arena
+ * @return the region, or NULL if it could not be mapped
+ */
+static void *map_region(size_t size, size_t align, unsigned flags)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    int map = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    
+    if(align < HUGE_PAGE)
+    {
+        align = HUGE_PAGE;
+    }
+    
+    //Map align bytes more than needed and unmap the ends around the aligned start
+    
+    char *p = mmap(NULL, size + align, prot, map, -1, 0);
+    
+    if(p == MAP_FAILED)
+    {
+        return NULL;
+    }
+    
+    char *start = (char *)(((unsigned long)p + align - 1) & ~(align - 1));
+    
+    if(start > p)
+    {
+        munmap(p, start - p);
+    }
+    
+    if(p + align > start)
+    {
+        munmap(start + size, p + align - start);
+    }
+    
+    if((flags & BUDDY_HUGEPAGE) && size % HUGE_PAGE == 0)
+    {
+        //Huge pages replace the aligned range in place, as MAP_HUGETLB alone
+        //only aligns to a huge page. Without MAP_NORESERVE the mapping fails
+        //up front, rather than with SIGBUS on first touch, when too few huge
+        //pages are reserved. A failed MAP_FIXED may leave a hole, so the
+        //range is then mapped again with small pages.
+        
+        if(mmap(start, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED,
+                -1, 0) != MAP_FAILED)
+        {
+            return start;
+        }
+        
+        if(mmap(start, size, prot, map | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            munmap(start, size);
+            return NULL;
+        }
+    }
+    
+    if(flags & BUDDY_HUGEPAGE)
+    {
+        madvise(start, size, MADV_HUGEPAGE);
+    }
+    
+    return start;
+}
+
+/**
+ * Create an arena managing a caller-supplied region, or a region of its own.
+ *
+ * The region is not touched until blocks are handed out; the arena's own
+ * bookkeeping is allocated separately and released by buddy_arena_destroy().
+ *
+ * @param region memory to manage, or NULL to map an anonymous region that
+ *        buddy_arena_destroy() unmaps
+ * @param size size of the region in bytes: a multiple of 1 << min_order of at
+ *        most 1 << max_order
+ * @param min_order order of the smallest block (the page size)
+ * @param max_order order of the largest block, up to 62 and less than
+ *        min_order + 31 so page indices fit in an int
+ * @param flags BUDDY_CONCURRENT to make the arena safe to use from many threads
+ * @return the new arena, or NULL if the arguments are invalid or out of memory
+ */
+buddy_arena_t *buddy_arena_create(void *region, size_t size, int min_order, int max_order,
+                                  unsigned flags)
+{
+    if(min_order < 1 || max_order < min_order ||
+       max_order >= 8 * (int)sizeof(long) - 1 || max_order - min_order >= 31 ||
+       size == 0 || size > 1UL << max_order || size & ((1UL << min_order) - 1))
+    {
+        return NULL;
+    }
+    
+    //The arena, its free areas, page structures and bitmaps share one allocation.
+    //The free areas start on a cache line so each order's lock has its own.
+    
+    int page_num = size >> min_order;
+    size_t head = (sizeof(buddy_arena_t) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    size_t nbits, nsummary;
+    
+    area_words(min_order, max_order, page_num, &nbits, &nsummary);
+
+#if USE_COMPACT == 1
+    // a free-list link each way for the list engine, plus one for the stack
+    int links = (USE_BITMAP == 0 && USE_INTRUSIVE == 0 ? 2 : 0) +
+        ((flags & BUDDY_LOCKFREE) ? 1 : 0);
+    size_t page_bytes = (size_t)page_num * (links * sizeof(unsigned) + sizeof(short));
+#else
+    size_t page_bytes = (size_t)page_num * sizeof(page_t);
+#endif
+    size_t bytes = head +
+        (max_order + 1) * sizeof(free_area_t) +
+        (nbits + nsummary) * sizeof(unsigned long) +
+        page_bytes;
+    
+    bytes = (bytes + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    
+    //Mapped rather than allocated: the kernel hands it out zeroed and only
+    //faults in the pages of metadata that get used. Like the region, it is
+    //not charged against the commit limit up front.
+    
+    buddy_arena_t *a = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    
+    if(a == MAP_FAILED)
+    {
+        return NULL;
+    }
+    
+    if(region == NULL)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t len = (size + page - 1) & ~(page - 1);
+        
+        //Aligned to its largest block, so any block is aligned in memory
+        
+        region = map_region(len, 1UL << (8 * (int)sizeof(long) - 1 - __builtin_clzl(size)), flags);
+        
+        if(region == NULL)
+        {
+            munmap(a, bytes);
+            return NULL;
+        }
+        
+        a->mapped = len;
+    }
+    
+    a->memory = region;
+    a->min_order = min_order;
+    a->max_order = max_order;
+    a->page_num = page_num;
+    a->flags = flags;
+    a->free_area = (free_area_t *)((char *)a + head);
+    a->meta_bytes = bytes;
+    
+    // widest first: bitmap words, then page structures or arrays
+    char *next = (char *)(a->free_area + max_order + 1);
+
+#if USE_BITMAP == 1
+    a->bitmap_words = (unsigned long *)next;
+    a->summary_words = a->bitmap_words + nbits;
+    next = (char *)(a->summary_words + nsummary);
+#endif
+#if USE_COMPACT == 1
+    unsigned *link = (unsigned *)next;
+
+#  if USE_BITMAP == 0 && USE_INTRUSIVE == 0
+    a->page_next = link;
+    a->page_prev = link + page_num;
+    link += 2 * (size_t)page_num;
+#  endif
+    if(flags & BUDDY_LOCKFREE)
+    {
+        a->stack_next = link;
+        link += page_num;
+    }
+    
+    a->page_states = (short *)link;
+#else
+    a->pages = (page_t *)next;
+#endif
+
+    for(int o = min_order; o <= max_order; o++)
+    {
+        pthread_mutex_init(&a->free_area[o].lock, NULL);
+    }
+    
+    pthread_mutex_init(&a->batch_lock, NULL);
+    
+    if(flags & BUDDY_SLAB)
+    {
+        a->slabs = slab_cache_create(a, min_order, max_order, flags & BUDDY_CONCURRENT);
+        
+        if(a->slabs == NULL)
+        {
+            buddy_arena_destroy(a);
+            return NULL;
+        }
+    }
+    
+    buddy_arena_reset(a);
+    
+    return a;
+}
+
+/**
+ * Release an arena's bookkeeping, and its region if the arena mapped it.
+ * A caller-supplied region stays the caller's.
+ */
+void buddy_arena_destroy(buddy_arena_t *a)
+{
+    if(a->mapped != 0)
+    {
+        munmap(a->memory, a->mapped);
+    }
+    
+    if(a->slabs != NULL)
+    {
+        slab_cache_destroy(a->slabs);
+    }
+    
+    free(a->pcp);
+    free(a->purge_stamps);
+    
+    for(int o = a->min_order; o <= a->max_order; o++)
+    {
+        pthread_mutex_destroy(&a->free_area[o].lock);
+    }
+    
+    pthread_mutex_destroy(&a->batch_lock);
+    munmap(a, a->meta_bytes);
+}
+
+/**
+ * Zero the page structures and bitmaps, leaving every page PAGE_NONE and no
+ * block free. Whole pages of them are dropped rather than written, so they
+ * are faulted back in, zeroed, only as blocks are split across them.
+ */
+static void clear_metadata(buddy_arena_t *a)
+{
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    char *start = (char *)(a->free_area + a->max_order + 1);
+    char *end = (char *)a + a->meta_bytes;
+    char *lo = (char *)(((unsigned long)start + page - 1) & ~(page - 1));
+    char *hi = (char *)((unsigned long)end & ~(page - 1));
+    
+    if(hi <= lo)
+    {
+        memset(start, 0, end - start);
+        return;
+    }
+    
+    memset(start, 0, lo - start);
+    madvise(lo, hi - lo, MADV_DONTNEED);
+    memset(hi, 0, end - hi);
+}
+
+/**
+ * Return every block of an arena to the free areas at once, leaving the whole
+ * region free in the largest aligned blocks that fit. No other thread may be
+ * using the arena.
+ */
+void buddy_arena_reset(buddy_arena_t *a)
+{
+	int i;
+	for (i = 0; a->pcp != NULL && i < a->pcp_slots; i++) {
+		memset(a->pcp[i].count, 0, sizeof(a->pcp[i].count));
+	}
+	a->stack_head = 0;
+	if (a->slabs != NULL) {
+		slab_cache_reset(a->slabs);
+	}
+	/* pages are initialized lazily: zeroed metadata is PAGE_NONE throughout */
+	clear_metadata(a);
+
+	/* initialize freelist */
+	area_init(a);
+	for (i = a->min_order; i <= a->max_order; i++) {
+		a->free_area[i].nsplit = 0;
+		a->free_area[i].nmerge = 0;
+	}
+
+	/* add the memory as the largest aligned blocks that fit, a single block
+	 * when the region is 1 << max_order bytes */
+	for (i = 0; i < a->page_num; ) {
+		int o = a->max_order;
+
+		while ((i & ((1 << (o - a->min_order)) - 1)) ||
+		       a->page_num - i < 1 << (o - a->min_order))
+			o--;
+		area_add(a, o, i);
+		i += 1 << (o - a->min_order);
+	}
+}
+
+/**
+ * Initialize the buddy system
+ */
+void buddy_init()
+{
+    if(g_heap == NULL)
+    {
+        g_heap = buddy_heap_create(MIN_ORDER, MAX_ORDER, HEAP_CHUNKS, 0);
+    }
+    else
+    {
+        buddy_heap_reset(g_heap);
+    }
+}
+
+/**
+ * Order of the smallest block holding size bytes and no smaller than
+ * 1 << min_order: the bit width of size - 1, from a count of leading zeros.
+ * Setting the bits below min_order lifts smaller sizes to min_order without a
+ * branch, and a size of 0 counts as 1.
+ *
+ * @param size size in bytes
+ * @param min_order order of the smallest block, at least 1
+ * @return the order
+ */
+int buddy_size_order(size_t size, int min_order)
+{
+    unsigned long bits = (size - (size != 0)) | ((1UL << min_order) - 1);
+    
+    return 8 * (int)sizeof(long) - __builtin_clzl(bits);
+}
+
+/**
+ * Find the order of the smallest block of the arena needed for a memory
+ * allocation.
+ *
+ * @return the order, or max_order + 1 if the request cannot fit in the arena
+ */
+
+int order_exp(buddy_arena_t *a, size_t size)
+{
+    int order = buddy_size_order(size, a->min_order);
+    
+    return order <= a->max_order ? order : a->max_order + 1;
+}
+
+void split(buddy_arena_t *a, int order, int targetOrder, int index)
+{
+
+    if(order == targetOrder)
+    {
+        return;
+    }
+    
+    //Get the page index of the upper half
+    
+    int buddy_index = BUDDY_PAGE(a, index, order - 1);
+    
+    //Add it to the proper free area, recording its order so buddy_free can find it
+    
+    area_lock(a, order - 1);
+    area_add(a, order - 1, buddy_index);
+    a->free_area[order - 1].nsplit++;
+    area_unlock(a, order - 1);
+    
+    //Recursive call to keep splitting if necessary
+    
+    split(a, order-1, targetOrder, index);
+
+}
+
+/**
+ * Coalesce the block at page index with its buddy for as long as the buddy is
+ * free and of the same order, then put the result on its free list.
+ *
+ * The buddy check reads the page state (or the order's bitmap), so each order costs O(1)
+ * no matter how long the free lists are.
+ */
+void merge(buddy_arena_t *a, int order, int index)
+{
+    int buddy_index = BUDDY_PAGE(a, index, order);
+    
+    area_lock(a, order);
+    
+    if(order == a->max_order || !area_is_free(a, order, buddy_index))
+    {
+        area_add(a, order, index);
+        area_unlock(a, order);
+        return;
+    }
+    
+    //Our buddy is free, so take it off its free area and continue with the pair
+    
+    area_del(a, order, buddy_index);
+    a->free_area[order].nmerge++;
+    area_unlock(a, order);
+    
+    if(buddy_index < index)
+    {
+        set_page_state(a, index, PAGE_NONE);
+        index = buddy_index;
+    }
+    else
+    {
+        set_page_state(a, buddy_index, PAGE_NONE);
+    }
+    
+    merge(a, order+1, index);
+}
+
+/**
+ * Put a freed block on its free area without merging it, if the arena is
+ * lazy and the order holds fewer than lazy_threshold free blocks
+ *
+ * @return 1 if the block was put on its free area, 0 if it should be merged
+ */
+static int lazy_add(buddy_arena_t *a, int order, int index)
+{
+    if(a->lazy_threshold == 0)
+    {
+        return 0;
+    }
+    
+    area_lock(a, order);
+    
+    int keep = area_count(a, order) < a->lazy_threshold;
+    
+    if(keep)
+    {
+        area_add(a, order, index);
+    }
+    
+    area_unlock(a, order);
+    
+    return keep;
+}
+
+/**
+ * Merge every pair of free buddies left uncoalesced by lazy frees
+ *
+ * Orders are swept from the bottom up, so pairs formed by merging one order
+ * are found again at the next.
+ */
+static void coalesce(buddy_arena_t *a)
+{
+    for(int o = a->min_order; o < a->max_order; o++)
+    {
+        int step = 1 << (o + 1 - a->min_order);
+        
+        for(int index = 0; index < a->page_num; index += step)
+        {
+            int buddy_index = BUDDY_PAGE(a, index, o);
+            
+            area_lock(a, o);
+            
+            if(!area_is_free(a, o, index) || !area_is_free(a, o, buddy_index))
+            {
+                area_unlock(a, o);
+                continue;
+            }
+            
+            area_del(a, o, index);
+            area_del(a, o, buddy_index);
+            a->free_area[o].nmerge++;
+            area_unlock(a, o);
+            
+            set_page_state(a, buddy_index, PAGE_NONE);
+            merge(a, o + 1, index);
+        }
+    }
+}
+
+/**
+ * Take a block of order off the free areas, splitting the smallest free block
+ * of order lowest or above
+ *
+ * @return page index of the block, or -1 if no block is large enough
+ */
+static int alloc_from(buddy_arena_t *a, int order, int lowest)
+{
+    for(;;)
+    {
+        //The lowest set bit of the free mask at or above lowest is the
+        //smallest order with a free block
+        unsigned long avail = __atomic_load_n(&a->free_mask, __ATOMIC_RELAXED) & (~0UL << lowest);
+        
+        if(avail == 0)
+        {
+            return -1;
+        }
+        
+        int i = __builtin_ctzl(avail);
+        
+        area_lock(a, i);
+        int cur_index = area_pop(a, i);
+        area_unlock(a, i);
+        
+        //Another thread may have emptied the order after we read the mask
+        
+        if(cur_index < 0)
+        {
+            continue;
+        }
+        
+        set_page_state(a, cur_index, order);
+        
+        //If the block is larger than we need, split the upper halves off
+        
+        split(a, i, order, cur_index);
+        
+        return cur_index;
+    }
+}
+
+/**
+ * Take a block of order off the free areas, splitting a larger one if needed
+ *
+ * @return page index of the block, or -1 if no block is large enough
+ */
+static int alloc_order(buddy_arena_t *a, int order)
+{
+    return alloc_from(a, order, order);
+}
+
+/**
+ * Pop a min_order block off the lock-free stack
+ *
+ * Every push and pop bumps the generation tag in the head, so a head that was
+ * popped and pushed back between our read and our compare-and-swap no longer
+ * compares equal (no ABA). The next link of a block we lose the race for may
+ * be stale, but the swap then fails and it is never used.
+ *
+ * @return page index of the block, or -1 if the stack is empty
+ */
+static int stack_pop(buddy_arena_t *a)
+{
+    unsigned long head = __atomic_load_n(&a->stack_head, __ATOMIC_ACQUIRE);
+    unsigned long next;
+    
+    do
+    {
+        unsigned top = (unsigned)head;
+        
+        if(top == 0)
+        {
+            return -1;
+        }
+        
+        next = ((head >> 32) + 1) << 32 |
+            __atomic_load_n(stack_link(a, top - 1), __ATOMIC_RELAXED);
+    }
+    while(!__atomic_compare_exchange_n(&a->stack_head, &head, next, 1,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    
+    return (unsigned)head - 1;
+}
+
+/**
+ * Push a min_order block on the lock-free stack
+ */
+static void stack_push(buddy_arena_t *a, int index)
+{
+    unsigned long head = __atomic_load_n(&a->stack_head, __ATOMIC_RELAXED);
+    unsigned long next;
+    
+    do
+    {
+        __atomic_store_n(stack_link(a, index), (unsigned)head, __ATOMIC_RELAXED);
+        next = ((head >> 32) + 1) << 32 | (unsigned)(index + 1);
+    }
+    while(!__atomic_compare_exchange_n(&a->stack_head, &head, next, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Take a block of order, from the lock-free stack when it is for min_order
+ *
+ * @return page index of the block, or -1 if no block is large enough
+ */
+static int alloc_block(buddy_arena_t *a, int order)
+{
+    if(order == a->min_order && (a->flags & BUDDY_LOCKFREE))
+    {
+        int index = stack_pop(a);
+        
+        if(index >= 0)
+        {
+            return index;
+        }
+    }
+    
+    return alloc_order(a, order);
+}
+
+/**
+ * Give back a block of order, to the lock-free stack when it is for min_order
+ */
+static void free_block(buddy_arena_t *a, int order, int index)
+{
+    if(order == a->min_order && (a->flags & BUDDY_LOCKFREE))
+    {
+        stack_push(a, index);
+    }
+    else if(!lazy_add(a, order, index))
+    {
+        merge(a, order, index);
+    }
+}
+
+/**
+ * Claim the cache of the calling thread's CPU
+ *
+ * @return the cache, or NULL if caching is off or another thread holds it
+ */
+static pcp_t *pcp_get(buddy_arena_t *a)
+{
+    if(a->pcp == NULL)
+    {
+        return NULL;
+    }
+    
+    int cpu = sched_getcpu();
+    pcp_t *pcp = &a->pcp[(cpu < 0 ? 0 : cpu) % a->pcp_slots];
+    
+    if(__atomic_exchange_n(&pcp->busy, 1, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    
+    return pcp;
+}
+
+/**
+ * Release a cache claimed with pcp_get()
+ */
+static void pcp_put(pcp_t *pcp)
+{
+    __atomic_store_n(&pcp->busy, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Give cached blocks of one order back to the free areas until count are left
+ */
+static void pcp_drain(buddy_arena_t *a, pcp_t *pcp, int k, int count)
+{
+    while(pcp->count[k] > count)
+    {
+        free_block(a, a->min_order + k, pcp->blocks[k][--pcp->count[k]]);
+    }
+}
+
+/**
+ * Give every cached block, and every block on the lock-free stack, back to
+ * the free areas, and coalesce the blocks a lazy arena left unmerged
+ *
+ * Waits for each cache in turn while the thread using it finishes. Slabs are
+ * left alone, since this runs under a slab class lock when a slab block
+ * cannot be allocated.
+ */
+static void drain_caches(buddy_arena_t *a)
+{
+    for(int s = 0; a->pcp != NULL && s < a->pcp_slots; s++)
+    {
+        pcp_t *pcp = &a->pcp[s];
+        
+        while(__atomic_exchange_n(&pcp->busy, 1, __ATOMIC_ACQUIRE))
+        {
+            sched_yield();
+        }
+        
+        for(int k = 0; k < PCP_ORDERS; k++)
+        {
+            pcp_drain(a, pcp, k, 0);
+        }
+        
+        pcp_put(pcp);
+    }
+    
+    int index;
+    
+    while((index = stack_pop(a)) >= 0)
+    {
+        merge(a, a->min_order, index);
+    }
+    
+    if(a->lazy_threshold != 0)
+    {
+        coalesce(a);
+    }
+}
+
+/**
+ * Give every cached block, every block on the lock-free stack and every
+ * empty slab back to the free areas
+ */
+void buddy_arena_drain(buddy_arena_t *a)
+{
+    if(a->slabs != NULL)
+    {
+        slab_cache_shrink(a->slabs);
+    }
+    
+    drain_caches(a);
+}
+
+/**
+ * Take a block of a cached order from the CPU's cache, refilling it with a
+ * batch of blocks from the free areas when it is empty.
+ *
+ * @return page index of the block, or -1 to fall back to the free areas
+ */
+static int pcp_alloc(buddy_arena_t *a, int order)
+{
+    int k = order - a->min_order;
+    pcp_t *pcp = pcp_get(a);
+    
+    if(pcp == NULL)
+    {
+        return -1;
+    }
+    
+    //An empty cache is refilled with a whole batch at once
+    
+    int index;
+    
+    if(pcp->count[k] == 0)
+    {
+        while(pcp->count[k] < a->pcp_batch && (index = alloc_block(a, order)) >= 0)
+        {
+            pcp->blocks[k][pcp->count[k]++] = index;
+        }
+    }
+    
+    index = pcp->count[k] > 0 ? pcp->blocks[k][--pcp->count[k]] : -1;
+    
+    pcp_put(pcp);
+    return index;
+}
+
+/**
+ * Put a freed block of a cached order in the CPU's cache, draining the cache
+ * down to its low watermark once it goes over its high one.
+ *
+ * @return 1 if the block was cached, 0 to fall back to the free areas
+ */
+static int pcp_free(buddy_arena_t *a, int order, int index)
+{
+    int k = order - a->min_order;
+    pcp_t *pcp = pcp_get(a);
+    
+    if(pcp == NULL)
+    {
+        return 0;
+    }
+    
+    pcp->blocks[k][pcp->count[k]++] = index;
+    
+    if(pcp->count[k] > a->pcp_high)
+    {
+        pcp_drain(a, pcp, k, a->pcp_low);
+    }
+    
+    pcp_put(pcp);
+    return 1;
+}
+
+/**
+ * Turn on per-CPU caches of the lowest PCP_ORDERS orders, or turn them off.
+ *
+ * Each CPU gets its own cache of ready-made blocks. An empty cache is refilled
+ * with batch blocks at once; a cache holding more than high blocks of an order
+ * is drained back to low of them. Must not be called while other threads are
+ * using the arena.
+ *
+ * @param a arena
+ * @param low blocks of each order left in a cache after draining it
+ * @param high blocks of each order a cache may hold, 0 to turn caching off
+ * @param batch blocks moved from the free areas when refilling a cache
+ * @return 0 on success, -1 if the watermarks are invalid or out of memory
+ */
+int buddy_arena_set_pcp(buddy_arena_t *a, int low, int high, int batch)
+{
+    if(high != 0 && (low < 0 || low >= high || batch < 1 || batch > high))
+    {
+        return -1;
+    }
+    
+    drain_caches(a);
+    free(a->pcp);
+    a->pcp = NULL;
+    
+    if(high == 0)
+    {
+        return 0;
+    }
+    
+    //The caches are followed by the block stacks of every cache and order,
+    //each with room for one block over the high watermark
+    
+    int slots = sysconf(_SC_NPROCESSORS_CONF);
+    
+    slots = slots < 1 ? 1 : slots;
+    
+    size_t bytes = slots * sizeof(pcp_t) + (size_t)slots * PCP_ORDERS * (high + 1) * sizeof(int);
+    pcp_t *pcp = aligned_alloc(CACHE_LINE, (bytes + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+    
+    if(pcp == NULL)
+    {
+        return -1;
+    }
+    
+    int *blocks = (int *)(pcp + slots);
+    
+    for(int s = 0; s < slots; s++)
+    {
+        pcp[s].busy = 0;
+        
+        for(int k = 0; k < PCP_ORDERS; k++)
+        {
+            pcp[s].count[k] = 0;
+            pcp[s].blocks[k] = blocks;
+            blocks += high + 1;
+        }
+    }
+    
+    a->pcp_slots = slots;
+    a->pcp_low = low;
+    a->pcp_high = high;
+    a->pcp_batch = batch;
+    a->pcp = pcp;
+    
+    return 0;
+}
+
+/**
+ * Turn lazy coalescing on or off.
+ *
+ * A lazy arena puts a freed block straight on its free area, without looking
+ * for its buddy, while that order holds fewer than threshold free blocks. A
+ * size that is freed and allocated again in turn then never splits or merges.
+ * The blocks left unmerged are coalesced when an allocation would otherwise
+ * fail, and by buddy_arena_drain().
+ *
+ * @param a the arena
+ * @param threshold free blocks each order may keep unmerged, 0 to always merge
+ * @return 0 on success, -1 if threshold is negative
+ */
+int buddy_arena_set_lazy(buddy_arena_t *a, int threshold)
+{
+    if(threshold < 0)
+    {
+        return -1;
+    }
+    
+    a->lazy_threshold = threshold;
+    
+    if(threshold == 0)
+    {
+        coalesce(a);
+    }
+    
+    return 0;
+}
+
+/**
+ * Read the arena's purge clock
+ *
+ * @return milliseconds since purging was set up, plus one so a dirty chunk
+ *         never has a stamp of 0
+ */
+static unsigned purge_clock(buddy_arena_t *a)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000 - a->epoch + 1;
+}
+
+/**
+ * Turn purging on or off.
+ *
+ * The region is divided into chunks of 1 << order bytes, each stamped with
+ * the time it was last dirtied: whenever a block covering or inside it is
+ * freed. A chunk that lies within a free block and has stayed dirty for
+ * decay_ms is handed back to the kernel with madvise(). Stamps belong to the
+ * memory rather than to blocks, so a chunk freed over and over stays young
+ * and is not purged and faulted back in, however its free block merges with
+ * its neighbours. Passes run from the free path once per decay interval, or
+ * on buddy_arena_purge().
+ *
+ * @param a the arena; its region must start on a page boundary
+ * @param order order of a chunk, at least the system page size; 0 turns
+ *        purging off
+ * @param decay_ms milliseconds a free chunk stays dirty before it is purged
+ * @param lazy_free non-zero for MADV_FREE, which lets the kernel take the pages
+ *        only under memory pressure, instead of MADV_DONTNEED
+ * @return 0 on success, -1 if the order or region is unsuitable or out of memory
+ */
+int buddy_arena_set_purge(buddy_arena_t *a, int order, unsigned decay_ms, int lazy_free)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    
+    if(order != 0 && (order < a->min_order || order > a->max_order || (1L << order) < page ||
+                      (unsigned long)a->memory % page != 0))
+    {
+        return -1;
+    }
+    
+    free(a->purge_stamps);
+    a->purge_stamps = NULL;
+    
+    if(order == 0)
+    {
+        return 0;
+    }
+    
+    //Every chunk starts out dirty, as nothing is known about the region. A
+    //region that is not a multiple of the chunk size ends in a partial chunk.
+    
+    int shift = order - a->min_order;
+    int nchunks = (a->page_num + (1 << shift) - 1) >> shift;
+    unsigned *stamps = malloc(nchunks * sizeof(unsigned));
+    
+    if(stamps == NULL)
+    {
+        return -1;
+    }
+    
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    a->epoch = ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+    
+    for(int c = 0; c < nchunks; c++)
+    {
+        stamps[c] = 1;
+    }
+    
+    a->last_purge = 1;
+    a->purge_order = order;
+    a->purge_decay = decay_ms;
+#ifdef MADV_FREE
+    a->purge_advice = lazy_free ? MADV_FREE : MADV_DONTNEED;
+#else
+    (void)lazy_free;
+    a->purge_advice = MADV_DONTNEED;
+#endif
+    a->purge_stamps = stamps;
+    
+    return 0;
+}
+
+/**
+ * Hand the chunks of the free block at page index that are old enough back
+ * to the kernel, in runs of neighbouring chunks. The block's order lock is held.
+ *
+ * @return bytes purged
+ */
+static size_t purge_block(buddy_arena_t *a, int order, int index, unsigned now)
+{
+    int shift = a->purge_order - a->min_order;
+    int first = index >> shift;
+    int end = first + (1 << (order - a->purge_order));
+    size_t bytes = 0;
+    
+    for(int c = first; c < end; )
+    {
+        //A chunk stamped after we read the clock has a negative age and is
+        //skipped like a young one
+        
+        int run = c;
+        
+        //Freeing threads stamp chunks without the order lock we hold
+        
+        unsigned stamp;
+        
+        while(run < end &&
+              (stamp = __atomic_load_n(&a->purge_stamps[run], __ATOMIC_RELAXED)) != 0 &&
+              (int)(now - stamp) >= (int)a->purge_decay)
+        {
+            run++;
+        }
+        
+        if(run == c)
+        {
+            c++;
+            continue;
+        }
+        
+        //A partial chunk at the end of the region is purged only up to the end
+        
+        int last_page = run << shift < a->page_num ? run << shift : a->page_num;
+        size_t len = (size_t)(last_page - (c << shift)) << a->min_order;
+        char *addr = PAGE_TO_ADDR(a, c << shift);
+        
+#if USE_INTRUSIVE == 1
+        //The block's first page holds its free-list links: keep it
+        
+        if(c == first)
+        {
+            addr += 1UL << a->min_order;
+            len -= 1UL << a->min_order;
+        }
+#endif
+        int ret = len == 0 ? 0 : madvise(addr, len, a->purge_advice);
+        
+        //A kernel without MADV_FREE rejects it; fall back for good
+        
+        if(ret != 0 && a->purge_advice != MADV_DONTNEED)
+        {
+            a->purge_advice = MADV_DONTNEED;
+            ret = madvise(addr, len, MADV_DONTNEED);
+        }
+        
+        if(ret == 0)
+        {
+            bytes += len;
+            
+            while(c < run)
+            {
+                __atomic_store_n(&a->purge_stamps[c++], 0, __ATOMIC_RELAXED);
+            }
+        }
+        
+        c = run;
+    }
+    
+    return bytes;
+}
+
+/**
+ * Purge every chunk that lies within a free block and has been dirty for at
+ * least the decay interval.
+ *
+ * @return bytes purged by this pass
+ */
+size_t buddy_arena_purge(buddy_arena_t *a)
+{
+    if(a->purge_stamps == NULL)
+    {
+        return 0;
+    }
+    
+    unsigned now = purge_clock(a);
+    int shift = a->purge_order - a->min_order;
+    int nchunks = (a->page_num + (1 << shift) - 1) >> shift;
+    size_t bytes = 0;
+    
+    for(int c = 0; c < nchunks; )
+    {
+        //Find the free block holding the chunk from its page states, then
+        //make sure of it under the order's lock
+        
+        int index = c << shift;
+        int o;
+        
+        for(o = a->purge_order; o <= a->max_order; o++)
+        {
+            int head = index & ~((1 << (o - a->min_order)) - 1);
+            
+            if(page_state(a, head) == (o | PAGE_FREE))
+            {
+                index = head;
+                break;
+            }
+        }
+        
+        if(o > a->max_order)
+        {
+            c++;
+            continue;
+        }
+        
+        area_lock(a, o);
+        
+        if(area_is_free(a, o, index))
+        {
+            bytes += purge_block(a, o, index, now);
+        }
+        
+        area_unlock(a, o);
+        
+        c = (index >> shift) + (1 << (o - a->purge_order));
+    }
+    
+    __atomic_add_fetch(&a->purged, bytes, __ATOMIC_RELAXED);
+    
+    return bytes;
+}
+
+/**
+ * Stamp the purge chunks covered by, or holding, a block being freed, and
+ * run a purge pass if a decay interval has passed since the last one
+ */
+static void mark_dirty(buddy_arena_t *a, int order, int index)
+{
+    if(a->purge_stamps == NULL)
+    {
+        return;
+    }
+    
+    unsigned now = purge_clock(a);
+    int shift = a->purge_order - a->min_order;
+    int last = (index + (1 << (order - a->min_order)) - 1) >> shift;
+    
+    for(int c = index >> shift; c <= last; c++)
+    {
+        __atomic_store_n(&a->purge_stamps[c], now, __ATOMIC_RELAXED);
+    }
+    
+    //Whoever moves last_purge on runs the pass
+    
+    unsigned prev = __atomic_load_n(&a->last_purge, __ATOMIC_RELAXED);
+    
+    if((int)(now - prev) >= (int)a->purge_decay &&
+       __atomic_compare_exchange_n(&a->last_purge, &prev, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        buddy_arena_purge(a);
+    }
+}
+
+/**
+ * Take a block of order from wherever the arena keeps ready blocks: the CPU's
+ * cache, the lock-free stack, then the free areas. When all of them come up
+ * empty the caches are drained and the free areas tried once more.
+ *
+ * @return page index of the block, or -1 if out of memory
+ */
+static int alloc_index(buddy_arena_t *a, int order)
+{
+    int cur_index = -1;
+    
+    //Small blocks come from the CPU's cache when there is one
+    
+    if(order < a->min_order + PCP_ORDERS)
+    {
+        cur_index = pcp_alloc(a, order);
+    }
+    
+    if(cur_index < 0)
+    {
+        cur_index = alloc_block(a, order);
+    }
+    
+    //Out of memory: blocks sitting in the caches may be enough once merged
+    
+    if(cur_index < 0 && (a->pcp != NULL || (a->flags & BUDDY_LOCKFREE) || a->lazy_threshold != 0) &&
+       order <= a->max_order)
+    {
+        drain_caches(a);
+        cur_index = alloc_order(a, order);
+    }
+    
+    return cur_index;
+}
+
+/**
+ * Carve n blocks of order out of as few donor blocks as possible
+ *
+ * Each donor is the smallest free block holding all the blocks still wanted,
+ * or the largest free block if none does. It is taken off its free area once
+ * and cut into blocks of order without going through split(); the pieces not
+ * handed out go back to the free areas as the largest aligned blocks they
+ * form.
+ *
+ * @return number of blocks stored in blocks
+ */
+static int alloc_bulk(buddy_arena_t *a, int order, void **blocks, int n)
+{
+    int got = 0;
+    int drained = 0;
+    
+    while(got < n)
+    {
+        unsigned long avail = __atomic_load_n(&a->free_mask, __ATOMIC_RELAXED) & (~0UL << order);
+        
+        //Out of memory: blocks sitting in the caches may be enough once merged
+        
+        if(avail == 0)
+        {
+            if(drained || (a->pcp == NULL && !(a->flags & BUDDY_LOCKFREE) && a->lazy_threshold == 0))
+            {
+                break;
+            }
+            
+            drain_caches(a);
+            drained = 1;
+            continue;
+        }
+        
+        //Smallest order holding every block still wanted
+        
+        int want = order;
+        
+        while(want < a->max_order && (1 << (want - order)) < n - got)
+        {
+            want++;
+        }
+        
+        unsigned long big = avail & (~0UL << want);
+        int donor_order = big != 0 ? __builtin_ctzl(big) : 63 - __builtin_clzl(avail);
+        
+        area_lock(a, donor_order);
+        int donor = area_pop(a, donor_order);
+        area_unlock(a, donor_order);
+        
+        //Another thread may have emptied the order after we read the mask
+        
+        if(donor < 0)
+        {
+            continue;
+        }
+        
+        int pieces = 1 << (donor_order - order);
+        int step = 1 << (order - a->min_order);
+        int count = pieces < n - got ? pieces : n - got;
+        
+        for(int k = 0; k < count; k++)
+        {
+            set_page_state(a, donor + k * step, order);
+            blocks[got++] = PAGE_TO_ADDR(a, donor + k * step);
+        }
+        
+        //Free the rest as aligned blocks: from piece count up, each set bit
+        //of the position is the next block, doubling in size
+        
+        int pos = count;
+        
+        for(int o = order; pos < pieces; o++)
+        {
+            if(pos & (1 << (o - order)))
+            {
+                area_lock(a, o);
+                area_add(a, o, donor + pos * step);
+                area_unlock(a, o);
+                pos += 1 << (o - order);
+            }
+        }
+    }
+    
+    return got;
+}
+
+/**
+ * Give back a block of order, to the CPU's cache if it has one for the order
+ */
+static void release_index(buddy_arena_t *a, int order, int index)
+{
+    mark_dirty(a, order, index);
+    
+    if(order < a->min_order + PCP_ORDERS && pcp_free(a, order, index))
+    {
+        return;
+    }
+    
+    free_block(a, order, index);
+}
+
+/**
+ * Allocate a block of order for a slab, marking each of its pages as part of it
+ *
+ * @return the block, or NULL if out of memory
+ */
+void *buddy_slab_block_alloc(buddy_arena_t *a, int order)
+{
+    int index = alloc_index(a, order);
+    
+    if(index < 0)
+    {
+        return NULL;
+    }
+    
+    for(int i = 0; i < 1 << (order - a->min_order); i++)
+    {
+        set_page_state(a, index + i, order | PAGE_SLAB);
+    }
+    
+    return PAGE_TO_ADDR(a, index);
+}
+
+/**
+ * Give back a block allocated with buddy_slab_block_alloc()
+ */
+void buddy_slab_block_free(buddy_arena_t *a, void *block)
+{
+    int index = ADDR_TO_PAGE(a, block);
+    int order = PAGE_ORDER(page_state(a, index));
+    
+    for(int i = 1; i < 1 << (order - a->min_order); i++)
+    {
+        set_page_state(a, index + i, PAGE_NONE);
+    }
+    
+    set_page_state(a, index, order);
+    release_index(a, order, index);
+}
+
+/**
+ * Cut an allocated block of order down to the pages size needs
+ *
+ * The pages kept are split into the blocks given by the set bits of their
+ * count, largest first, and each block but the last is flagged PAGE_MORE so
+ * buddy_arena_free() frees the whole run. The pages after them go back to
+ * the free areas as the largest aligned blocks they form.
+ */
+static void trim(buddy_arena_t *a, int order, int index, size_t size)
+{
+    int pages = (size + (1UL << a->min_order) - 1) >> a->min_order;
+    int total = 1 << (order - a->min_order);
+    int pos = 0;
+    
+    // A zero-byte request still holds its first page
+    if(pages == 0)
+    {
+        pages = 1;
+    }
+    
+    if(pages >= total)
+    {
+        return;
+    }
+    
+    for(int o = order - 1; o >= a->min_order; o--)
+    {
+        int n = 1 << (o - a->min_order);
+        
+        if(pages & n)
+        {
+            set_page_state(a, index + pos, o | (pos + n < pages ? PAGE_MORE : 0));
+            pos += n;
+        }
+    }
+    
+    for(int o = a->min_order; pos < total; o++)
+    {
+        int n = 1 << (o - a->min_order);
+        
+        if(pos & n)
+        {
+            set_page_state(a, index + pos, o);
+            release_index(a, o, index + pos);
+            pos += n;
+        }
+    }
+}
+
+/**
+ * Allocate a memory block.
+ *
+ * On a memory request, the allocator returns the head of a free-list of the
+ * matching size (i.e., smallest block that satisfies the request). If the
+ * free-list of the matching block size is empty, then a larger block size will
+ * be selected. The selected (large) block is then splitted into two smaller
+ * blocks. Among the two blocks, left block will be used for allocation or be
+ * further splitted while the right block will be added to the appropriate
+ * free-list. In a BUDDY_SLAB arena, requests of up to SLAB_MAX_SIZE bytes are
+ * carved out of slabs instead.
+ *
+ * @param a arena to allocate from
+ * @param size size in bytes
+ * @return memory block address, or NULL if no block is large enough
+ */
+void *buddy_arena_alloc(buddy_arena_t *a, size_t size)
+{
+    //Small requests share a slab block with other objects of their size class
+    
+    if(a->slabs != NULL && size <= SLAB_MAX_SIZE)
+    {
+        void *obj = slab_alloc(a->slabs, size);
+        
+        if(obj != NULL)
+        {
+            return obj;
+        }
+    }
+    
+    //Gets the correct order based on the size of the request
+    int order = order_exp(a, size);
+    int cur_index = alloc_index(a, order);
+    
+    if(cur_index < 0)
+    {
+        return NULL;
+    }
+    
+    if(a->flags & BUDDY_EXACT)
+    {
+        trim(a, order, cur_index, size);
+    }
+    
+    return PAGE_TO_ADDR(a, cur_index);
+
+}
+
+/**
+ * Allocate a memory block aligned to a power of two.
+ *
+ * Slab objects are aligned to at least SLAB_ALIGN, those of power-of-two
+ * classes to their size, and a block of order o to 1 << o, counted from the
+ * start of the region, so they are aligned in memory only as far as the
+ * region itself is. Regions mapped by the arena start on a boundary of their
+ * largest block; a caller's region may not. In a BUDDY_SLAB arena, requests
+ * whose size and alignment fit a slab class come from slabs; others get a
+ * block of at least align bytes.
+ *
+ * @param a arena to allocate from
+ * @param size size in bytes
+ * @param align alignment in bytes, a power of two
+ * @return memory block address, or NULL if out of memory, align is not a
+ *         power of two or the region does not start on a multiple of align
+ */
+void *buddy_arena_alloc_aligned(buddy_arena_t *a, size_t size, size_t align)
+{
+    if(align == 0 || (align & (align - 1)) != 0 || ((unsigned long)a->memory & (align - 1)) != 0)
+    {
+        return NULL;
+    }
+    
+    if(align <= SLAB_ALIGN)
+    {
+        return buddy_arena_alloc(a, size);
+    }
+    
+    if(a->slabs != NULL && size <= SLAB_MAX_SIZE && align <= SLAB_MAX_SIZE)
+    {
+        void *obj = slab_alloc_aligned(a->slabs, size, align);
+        
+        if(obj != NULL)
+        {
+            return obj;
+        }
+    }
+    
+    int order = order_exp(a, size > align ? size : align);
+    
+    if(order > a->max_order)
+    {
+        return NULL;
+    }
+    
+    int index = alloc_index(a, order);
+    
+    if(index < 0)
+    {
+        return NULL;
+    }
+    
+    if(a->flags & BUDDY_EXACT)
+    {
+        trim(a, order, index, size);
+    }
+    
+    return PAGE_TO_ADDR(a, index);
+}
+
+/**
+ * Allocate a memory block from the default heap.
+ *
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_alloc(size_t size)
+{
+    return buddy_heap_alloc(g_heap, size);
+}
+
+/**
+ * Allocate n blocks of the same size in one call.
+ *
+ * Rather than searching and splitting once per block, a large donor block is
+ * cut into all the blocks it can supply at once. The blocks bypass the slabs
+ * and per-CPU caches and are freed with buddy_arena_free() as usual.
+ *
+ * @param a arena to allocate from
+ * @param size size in bytes of each block
+ * @param blocks array receiving the block addresses
+ * @param n number of blocks wanted
+ * @return number of blocks allocated, less than n if the arena ran out
+ */
+int buddy_arena_alloc_bulk(buddy_arena_t *a, size_t size, void **blocks, int n)
+{
+    int order = order_exp(a, size);
+    
+    if(order > a->max_order)
+    {
+        return 0;
+    }
+    
+    return alloc_bulk(a, order, blocks, n);
+}
+
+/**
+ * Allocate n blocks of the same size from the default heap.
+ *
+ * @return number of blocks allocated
+ */
+int buddy_alloc_bulk(size_t size, void **blocks, int n)
+{
+    return buddy_heap_alloc_bulk(g_heap, size, blocks, n);
+}
+
+/**
+ * Free an allocated memory block.
+ *
+ * Whenever a block is freed, the allocator checks its buddy. If the buddy is
+ * free as well, then the two buddies are combined to form a bigger block. This
+ * process continues until one of the buddies is not free. Small blocks go to
+ * the CPU's cache instead when the arena has per-CPU caches, and min_order
+ * blocks to the lock-free stack in a BUDDY_LOCKFREE arena.
+ *
+ * @param a arena the block was allocated from
+ * @param addr memory block address to be freed
+ */
+void buddy_arena_free(buddy_arena_t *a, void *addr)
+{
+    int free_index = ADDR_TO_PAGE(a, addr);
+    
+    //The order of the block was recorded in its page structure when it was allocated
+    
+    int state = page_state(a, free_index);
+    int order = PAGE_ORDER(state);
+    
+    //Objects carved from a slab go back to it; the slab block starts at the
+    //address rounded down to the block's order
+    
+    if(state & PAGE_SLAB)
+    {
+        unsigned long offset = (char *)addr - a->memory;
+        
+        slab_free(a->slabs, a->memory + (offset >> order << order), addr);
+        return;
+    }
+    
+    //An exact-size block is a run of blocks, each followed by the next
+    
+    while(state & PAGE_MORE)
+    {
+        int next = free_index + (1 << (order - a->min_order));
+        
+        set_page_state(a, free_index, order);
+        release_index(a, order, free_index);
+        
+        free_index = next;
+        state = page_state(a, free_index);
+        order = PAGE_ORDER(state);
+    }
+    
+    release_index(a, order, free_index);
+}
+
+/**
+ * Free a memory block of the default heap.
+ *
+ * @param addr memory block address to be freed
+ */
+void buddy_free(void *addr)
+{
+    buddy_heap_free(g_heap, addr);
+}
+
+/**
+ * Grow the allocated block at page index from order to target in place, by
+ * taking each of its upper buddies off the free areas
+ *
+ * @return 0 on success, -1 if the block is not the lower buddy at every order
+ *         up to target, or one of the buddies is not free at its order
+ */
+static int grow_in_place(buddy_arena_t *a, int order, int target, int index)
+{
+    if(index & ((1 << (target - a->min_order)) - 1))
+    {
+        return -1;
+    }
+    
+    int o;
+    
+    for(o = order; o < target; o++)
+    {
+        int buddy_index = BUDDY_PAGE(a, index, o);
+        
+        area_lock(a, o);
+        
+        if(!area_is_free(a, o, buddy_index))
+        {
+            area_unlock(a, o);
+            break;
+        }
+        
+        area_del(a, o, buddy_index);
+        area_unlock(a, o);
+    }
+    
+    //Put back the buddies already taken if one was missing
+    
+    if(o < target)
+    {
+        while(--o >= order)
+        {
+            area_lock(a, o);
+            area_add(a, o, BUDDY_PAGE(a, index, o));
+            area_unlock(a, o);
+        }
+        
+        return -1;
+    }
+    
+    for(o = order; o < target; o++)
+    {
+        set_page_state(a, BUDDY_PAGE(a, index, o), PAGE_NONE);
+    }
+    
+    set_page_state(a, index, target);
+    
+    return 0;
+}
+
+/**
+ * Usable size of an allocated block: its slab object size, the sum of the
+ * pieces of an exact-size block, or the size of its order
+ */
+static size_t block_size(buddy_arena_t *a, void *addr)
+{
+    int index = ADDR_TO_PAGE(a, addr);
+    int state = page_state(a, index);
+    int order = PAGE_ORDER(state);
+    
+    if(state & PAGE_SLAB)
+    {
+        unsigned long offset = (char *)addr - a->memory;
+        
+        return slab_size(a->slabs, a->memory + (offset >> order << order));
+    }
+    
+    size_t size = 1UL << order;
+    
+    while(state & PAGE_MORE)
+    {
+        index += 1 << (order - a->min_order);
+        state = page_state(a, index);
+        order = PAGE_ORDER(state);
+        size += 1UL << order;
+    }
+    
+    return size;
+}
+
+/**
+ * Resize an allocated block, in place when possible.
+ *
+ * A block shrinks in place by giving its upper halves back to the free areas,
+ * and grows in place when it is the lower buddy at every order it grows
+ * through and each of those upper buddies is free. Otherwise a new block is
+ * allocated, the contents copied and the old block freed.
+ *
+ * @param a arena the block was allocated from
+ * @param addr memory block address, or NULL to allocate
+ * @param size new size in bytes, or 0 to free
+ * @return address of the resized block, or NULL if there is no room; the old
+ *         block is then left untouched
+ */
+void *buddy_arena_realloc(buddy_arena_t *a, void *addr, size_t size)
+{
+    if(addr == NULL)
+    {
+        return buddy_arena_alloc(a, size);
+    }
+    
+    if(size == 0)
+    {
+        buddy_arena_free(a, addr);
+        return NULL;
+    }
+    
+    int index = ADDR_TO_PAGE(a, addr);
+    int state = page_state(a, index);
+    int order = PAGE_ORDER(state);
+    size_t old_size = block_size(a, addr);
+    
+    //An exact-size block is always copied
+    
+    if(state & PAGE_SLAB)
+    {
+        if(size <= old_size)
+        {
+            return addr;
+        }
+    }
+    else if(!(state & PAGE_MORE))
+    {
+        int target = order_exp(a, size);
+        
+        if(target > a->max_order)
+        {
+            return NULL;
+        }
+        
+        //Shrink: the upper half at each order down to the target is free
+        
+        if(target <= order)
+        {
+            set_page_state(a, index, target);
+            
+            for(int o = order - 1; o >= target; o--)
+            {
+                int buddy_index = BUDDY_PAGE(a, index, o);
+                
+                set_page_state(a, buddy_index, o);
+                release_index(a, o, buddy_index);
+            }
+            
+            return addr;
+        }
+        
+        if(grow_in_place(a, order, target, index) == 0)
+        {
+            return addr;
+        }
+    }
+    
+    //Moving a page block: split a larger free block if there is one, so the
+    //new block's upper buddy is still free when it grows again
+    
+    void *new_addr = NULL;
+    
+    if(!(state & PAGE_SLAB) && !(a->flags & BUDDY_EXACT) && order_exp(a, size) < a->max_order)
+    {
+        int target = order_exp(a, size);
+        int new_index = alloc_from(a, target, target + 1);
+        
+        new_addr = new_index < 0 ? NULL : PAGE_TO_ADDR(a, new_index);
+    }
+    
+    if(new_addr == NULL)
+    {
+        new_addr = buddy_arena_alloc(a, size);
+    }
+    
+    if(new_addr == NULL)
+    {
+        return NULL;
+    }
+    
+    memcpy(new_addr, addr, old_size < size ? old_size : size);
+    buddy_arena_free(a, addr);
+    
+    return new_addr;
+}
+
+/**
+ * Resize a block of the default heap, in place when possible.
+ */
+void *buddy_realloc(void *addr, size_t size)
+{
+    return buddy_heap_realloc(g_heap, addr, size);
+}
+
+/**
+ * Free many blocks in one call.
+ *
+ * Every block is first marked PAGE_BATCH in its page state. Blocks whose
+ * buddy is a marked block of the same order are then merged among
+ * themselves by rewriting page states only, the way merge() would but
+ * without touching the free areas. Only the blocks left at the end are
+ * merged into the free areas, each with a single insert. Slab objects and
+ * exact-size blocks are freed one at a time.
+ *
+ * The marks are plain page states, so in a concurrent arena one bulk free
+ * could take another's marked blocks for its own; bulk frees of the arena
+ * run one at a time. A single free never merges a marked block.
+ *
+ * @param a arena the blocks were allocated from
+ * @param blocks block addresses
+ * @param n number of blocks
+ */
+void buddy_arena_free_bulk(buddy_arena_t *a, void **blocks, int n)
+{
+    if(a->flags & BUDDY_CONCURRENT)
+    {
+        pthread_mutex_lock(&a->batch_lock);
+    }
+    
+    for(int i = 0; i < n; i++)
+    {
+        int index = ADDR_TO_PAGE(a, blocks[i]);
+        int state = page_state(a, index);
+        
+        if(state & (PAGE_SLAB | PAGE_MORE))
+        {
+            buddy_arena_free(a, blocks[i]);
+        }
+        else
+        {
+            mark_dirty(a, PAGE_ORDER(state), index);
+            set_page_state(a, index, state | PAGE_BATCH);
+        }
+    }
+    
+    //A block absorbed by its lower buddy loses its mark, so the head of each
+    //merged block is still the address of one of the blocks in the batch
+    
+    for(int i = 0; i < n; i++)
+    {
+        int index = ADDR_TO_PAGE(a, blocks[i]);
+        int state = page_state(a, index);
+        
+        while(state != PAGE_NONE && (state & PAGE_BATCH) && PAGE_ORDER(state) < a->max_order)
+        {
+            int order = PAGE_ORDER(state);
+            int buddy_index = BUDDY_PAGE(a, index, order);
+            
+            if(buddy_index >= a->page_num || page_state(a, buddy_index) != state)
+            {
+                break;
+            }
+            
+            if(buddy_index < index)
+            {
+                set_page_state(a, index, PAGE_NONE);
+                index = buddy_index;
+            }
+            else
+            {
+                set_page_state(a, buddy_index, PAGE_NONE);
+            }
+            
+            state = (order + 1) | PAGE_BATCH;
+            set_page_state(a, index, state);
+        }
+    }
+    
+    for(int i = 0; i < n; i++)
+    {
+        int index = ADDR_TO_PAGE(a, blocks[i]);
+        int state = page_state(a, index);
+        
+        if(state != PAGE_NONE && (state & PAGE_BATCH))
+        {
+            set_page_state(a, index, PAGE_ORDER(state));
+            merge(a, PAGE_ORDER(state), index);
+        }
+    }
+    
+    if(a->flags & BUDDY_CONCURRENT)
+    {
+        pthread_mutex_unlock(&a->batch_lock);
+    }
+}
+
+/**
+ * Free many blocks of the default heap in one call.
+ */
+void buddy_free_bulk(void **blocks, int n)
+{
+    buddy_heap_free_bulk(g_heap, blocks, n);
+}
+
+/**
+ * Print the buddy system status---order oriented
+ *
+ * print free pages in each order. Blocks held in per-CPU caches count as
+ * allocated; call buddy_arena_drain() first to see them as free.
+ */
+void buddy_arena_dump(buddy_arena_t *a)
+{
+	int o;
+	for (o = a->min_order; o <= a->max_order; o++) {
+		area_lock(a, o);
+		int cnt = area_count(a, o);
+		area_unlock(a, o);
+		printf("%d:%luK ", cnt, (1UL<<o)/1024);
+	}
+	printf("\n");
+}
+
+/**
+ * Work out how the arena would serve a request, without allocating: the
+ * slab class and its object size for small requests of a BUDDY_SLAB arena,
+ * otherwise the order of the buddy block and its size, or just the pages
+ * used in a BUDDY_EXACT arena.
+ *
+ * @param a arena the request would be made of
+ * @param size size in bytes
+ * @param cls filled in with the order, slab class and usable bytes
+ */
+void buddy_arena_size_class(buddy_arena_t *a, size_t size, buddy_class_t *cls)
+{
+    cls->slab = -1;
+    
+    if(a->slabs != NULL)
+    {
+        cls->slab = slab_size_class(a->slabs, size, &cls->order, &cls->usable);
+        
+        if(cls->slab >= 0)
+        {
+            return;
+        }
+    }
+    
+    cls->order = order_exp(a, size);
+    
+    if(cls->order > a->max_order)
+    {
+        cls->usable = 0;
+    }
+    else if(a->flags & BUDDY_EXACT)
+    {
+        cls->usable = (size + (1UL << a->min_order) - 1) & ~((1UL << a->min_order) - 1);
+    }
+    else
+    {
+        cls->usable = 1UL << cls->order;
+    }
+}
+
+/**
+ * Collect statistics about an arena
+ *
+ * @param a arena
+ * @param stats filled in with the arena's statistics
+ */
+void buddy_arena_stats(buddy_arena_t *a, buddy_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    
+    for(int o = a->min_order; o <= a->max_order; o++)
+    {
+        area_lock(a, o);
+        stats->free_bytes += (size_t)area_count(a, o) << o;
+        stats->nsplit += a->free_area[o].nsplit;
+        stats->nmerge += a->free_area[o].nmerge;
+        area_unlock(a, o);
+    }
+    
+    stats->purged_bytes = __atomic_load_n(&a->purged, __ATOMIC_RELAXED);
+    stats->meta_bytes = a->meta_bytes;
+}
+
+/**
+ * Lock a heap's chunks shared, if it is concurrent
+ */
+static inline void heap_read_lock(buddy_heap_t *h)
+{
+    if(h->flags & BUDDY_CONCURRENT)
+    {
+        pthread_rwlock_rdlock(&h->lock);
+    }
+}
+
+/**
+ * Lock a heap's chunks exclusively, if it is concurrent
+ */
+static inline void heap_write_lock(buddy_heap_t *h)
+{
+    if(h->flags & BUDDY_CONCURRENT)
+    {
+        pthread_rwlock_wrlock(&h->lock);
+    }
+}
+
+/**
+ * Unlock a heap's chunks, if it is concurrent
+ */
+static inline void heap_unlock(buddy_heap_t *h)
+{
+    if(h->flags & BUDDY_CONCURRENT)
+    {
+        pthread_rwlock_unlock(&h->lock);
+    }
+}
+
+/**
+ * Index of the chunk holding an address
+ */
+static inline int heap_chunk(buddy_heap_t *h, void *addr)
+{
+    return (unsigned long)((char *)addr - h->memory) >> h->max_order;
+}
+
+/**
+ * Is all of a chunk's memory in its one max_order block? Blocks held in
+ * caches or left uncoalesced by lazy merging keep a chunk in use.
+ */
+static inline int chunk_unused(buddy_arena_t *a)
+{
+    return (__atomic_load_n(&a->free_mask, __ATOMIC_RELAXED) >> a->max_order) & 1;
+}
+
+/**
+ * Is a chunk unused after a free? Slabs keep the last empty slab of each size
+ * class, so once no slab object of the chunk is in use its empty slabs are
+ * given back before deciding. The heap is locked shared.
+ */
+static int chunk_freed(buddy_arena_t *a)
+{
+    if(chunk_unused(a))
+    {
+        return 1;
+    }
+    
+    if(a->slabs == NULL || !slab_cache_idle(a->slabs))
+    {
+        return 0;
+    }
+    
+    slab_cache_shrink(a->slabs);
+    
+    return chunk_unused(a);
+}
+
+/**
+ * Bytes of a heap's header: the heap, its chunk table and its chunk masks
+ */
+static inline size_t heap_bytes(int max_chunks)
+{
+    return sizeof(buddy_heap_t) + max_chunks * sizeof(buddy_arena_t *) +
+        2 * BITMAP_WORDS(max_chunks) * sizeof(unsigned long);
+}
+
+/**
+ * Index of the first chunk at or after i whose bit is set in mask, the heap's
+ * mapped or room mask, or max_chunks if there is none. Walks skip a word of
+ * clear bits at a time. The heap is locked.
+ */
+static inline int heap_next(buddy_heap_t *h, unsigned long *mask, int i)
+{
+    if(i >= h->max_chunks)
+    {
+        return h->max_chunks;
+    }
+    
+    int w = i / BITS_PER_WORD;
+    unsigned long bits = __atomic_load_n(&mask[w], __ATOMIC_RELAXED) & (~0UL << (i % BITS_PER_WORD));
+    
+    while(bits == 0)
+    {
+        if(++w >= BITMAP_WORDS(h->max_chunks))
+        {
+            return h->max_chunks;
+        }
+        
+        bits = __atomic_load_n(&mask[w], __ATOMIC_RELAXED);
+    }
+    
+    return w * BITS_PER_WORD + __builtin_ctzl(bits);
+}
+
+/**
+ * Note that a block of chunk i was freed, so it has room again. The heap is
+ * locked shared.
+ */
+static inline void heap_room(buddy_heap_t *h, int i)
+{
+    unsigned long *word = &h->room[i / BITS_PER_WORD];
+    unsigned long bit = 1UL << (i % BITS_PER_WORD);
+    
+    if(!(__atomic_load_n(word, __ATOMIC_SEQ_CST) & bit))
+    {
+        __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Note that an allocation failed in chunk i. The chunk counts as full only
+ * when nothing is left on its free areas, as a smaller request may still fit.
+ * The heap is locked shared.
+ */
+static void heap_full(buddy_heap_t *h, int i)
+{
+    buddy_arena_t *a = h->chunks[i];
+    unsigned long *word = &h->room[i / BITS_PER_WORD];
+    unsigned long bit = 1UL << (i % BITS_PER_WORD);
+    
+    if(__atomic_load_n(&a->free_mask, __ATOMIC_RELAXED) != 0)
+    {
+        return;
+    }
+    
+    __atomic_fetch_and(word, ~bit, __ATOMIC_SEQ_CST);
+    
+    //A free that set the bit again before we cleared it has already put its
+    //block on a free area
+    
+    if(__atomic_load_n(&a->free_mask, __ATOMIC_SEQ_CST) != 0)
+    {
+        __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Map a new chunk into the first free slot. The heap is locked exclusively.
+ *
+ * @return the chunk's index, or -1 if the range is full or out of memory
+ */
+static int heap_add(buddy_heap_t *h)
+{
+    for(int w = 0; w < BITMAP_WORDS(h->max_chunks); w++)
+    {
+        if(~h->mapped[w] == 0)
+        {
+            continue;
+        }
+        
+        int i = w * BITS_PER_WORD + __builtin_ctzl(~h->mapped[w]);
+        
+        if(i >= h->max_chunks)
+        {
+            break;
+        }
+        
+        h->chunks[i] = buddy_arena_create(h->memory + ((size_t)i << h->max_order),
+                                          1UL << h->max_order, h->min_order,
+                                          h->max_order, h->flags);
+        
+        if(h->chunks[i] == NULL)
+        {
+            return -1;
+        }
+        
+        h->mapped[w] |= 1UL << (i % BITS_PER_WORD);
+        h->room[w] |= 1UL << (i % BITS_PER_WORD);
+        h->nchunks++;
+        return i;
+    }
+    
+    return -1;
+}
+
+/**
+ * Give a chunk's memory back to the kernel and drop its arena. The heap is
+ * locked exclusively.
+ */
+static void heap_remove(buddy_heap_t *h, int i)
+{
+    buddy_arena_destroy(h->chunks[i]);
+    madvise(h->memory + ((size_t)i << h->max_order), 1UL << h->max_order, MADV_DONTNEED);
+    h->chunks[i] = NULL;
+    h->mapped[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+    h->room[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+    h->nchunks--;
+    
+    if(h->hint == i)
+    {
+        h->hint = 0;
+    }
+}
+
+/**
+ * Release a chunk found unused after a free, or keep it as the spare when
+ * there is no unused spare already. Chunk 0 is never released.
+ */
+static void heap_release(buddy_heap_t *h, int i)
+{
+    heap_write_lock(h);
+    
+    //Nothing else runs now: make sure the chunk is still unused
+    
+    if(i != 0 && h->chunks[i] != NULL && chunk_unused(h->chunks[i]))
+    {
+        int spare = h->spare;
+        
+        if(spare < 0 || spare == i || h->chunks[spare] == NULL ||
+           !chunk_unused(h->chunks[spare]))
+        {
+            h->spare = i;
+        }
+        else
+        {
+            heap_remove(h, i);
+        }
+    }
+    
+    heap_unlock(h);
+}
+
+/**
+ * Create a heap that grows by chunks of 1 << max_order bytes
+ *
+ * Address space for max_chunks chunks is reserved up front; memory is
+ * mapped in as chunks are used and given back as they become free.
+ *
+ * @param min_order order of a page
+ * @param max_order order of a chunk, the largest block
+ * @param max_chunks most chunks the heap may hold at once
+ * @param flags BUDDY_* flags for every chunk's arena
+ * @return the heap, or NULL if the orders are invalid or out of memory
+ */
+buddy_heap_t *buddy_heap_create(int min_order, int max_order, int max_chunks, unsigned flags)
+{
+    if(max_chunks < 1 || max_order < 1 || max_order >= 8 * (int)sizeof(long) - 1 ||
+       (size_t)max_chunks > (~0UL >> 1) >> max_order)
+    {
+        return NULL;
+    }
+    
+    //Mapped like the arenas' bookkeeping, so a heap serving malloc() never
+    //calls it
+    
+    size_t bytes = heap_bytes(max_chunks);
+    buddy_heap_t *h = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    
+    if(h == MAP_FAILED)
+    {
+        return NULL;
+    }
+    
+    h->memory = map_region((size_t)max_chunks << max_order, 1UL << max_order, flags);
+    h->min_order = min_order;
+    h->max_order = max_order;
+    h->max_chunks = max_chunks;
+    h->flags = flags;
+    h->spare = -1;
+    h->mapped = (unsigned long *)&h->chunks[max_chunks];
+    h->room = h->mapped + BITMAP_WORDS(max_chunks);
+    pthread_rwlock_init(&h->lock, NULL);
+    
+    if(h->memory == NULL || heap_add(h) != 0)
+    {
+        if(h->memory != NULL)
+        {
+            munmap(h->memory, (size_t)max_chunks << max_order);
+        }
+        
+        pthread_rwlock_destroy(&h->lock);
+        munmap(h, bytes);
+        return NULL;
+    }
+    
+    return h;
+}
+
+/**
+ * Release a heap, its chunks and its address space
+ */
+void buddy_heap_destroy(buddy_heap_t *h)
+{
+    for(int i = heap_next(h, h->mapped, 0); i < h->max_chunks; i = heap_next(h, h->mapped, i + 1))
+    {
+        buddy_arena_destroy(h->chunks[i]);
+    }
+    
+    munmap(h->memory, (size_t)h->max_chunks << h->max_order);
+    pthread_rwlock_destroy(&h->lock);
+    munmap(h, heap_bytes(h->max_chunks));
+}
+
+/**
+ * Forget every allocation: release every chunk but the first and reset it.
+ * No other thread may be using the heap.
+ */
+void buddy_heap_reset(buddy_heap_t *h)
+{
+    for(int i = heap_next(h, h->mapped, 1); i < h->max_chunks; i = heap_next(h, h->mapped, i + 1))
+    {
+        heap_remove(h, i);
+    }
+    
+    buddy_arena_reset(h->chunks[0]);
+    h->hint = 0;
+    h->spare = -1;
+}
+
+/**
+ * Allocate from the chunk that served the last allocation, then from the
+ * others with room in address order. The heap is locked shared.
+ *
+ * @return the block, or NULL if no chunk has room
+ */
+static void *heap_try_alloc(buddy_heap_t *h, size_t size, size_t align)
+{
+    int hint = __atomic_load_n(&h->hint, __ATOMIC_RELAXED);
+    void *addr = buddy_arena_alloc_aligned(h->chunks[hint], size, align);
+    
+    if(addr != NULL)
+    {
+        return addr;
+    }
+    
+    heap_full(h, hint);
+    
+    for(int i = heap_next(h, h->room, 0); i < h->max_chunks; i = heap_next(h, h->room, i + 1))
+    {
+        if(i == hint)
+        {
+            continue;
+        }
+        
+        addr = buddy_arena_alloc_aligned(h->chunks[i], size, align);
+        
+        if(addr != NULL)
+        {
+            __atomic_store_n(&h->hint, i, __ATOMIC_RELAXED);
+            return addr;
+        }
+        
+        heap_full(h, i);
+    }
+    
+    return NULL;
+}
+
+/**
+ * Add a chunk once every chunk was found full. The heap is not locked.
+ *
+ * @return 0 if there may be room now, -1 if the heap cannot grow
+ */
+static int heap_grow(buddy_heap_t *h, int nchunks)
+{
+    int ret = 0;
+    
+    heap_write_lock(h);
+    
+    //Another thread may have added or released a chunk meanwhile
+    
+    if(h->nchunks == nchunks)
+    {
+        int i = heap_add(h);
+        
+        if(i < 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            h->hint = i;
+        }
+    }
+    
+    heap_unlock(h);
+    
+    return ret;
+}
+
+/**
+ * Allocate a memory block, adding a chunk when no chunk has room
+ *
+ * @param h heap to allocate from
+ * @param size size in bytes, at most the chunk size
+ * @return memory block address, or NULL if the heap is out of chunks
+ */
+void *buddy_heap_alloc(buddy_heap_t *h, size_t size)
+{
+    return buddy_heap_alloc_aligned(h, size, 1);
+}
+
+/**
+ * Allocate a memory block aligned to a power of two, as
+ * buddy_arena_alloc_aligned() does, adding a chunk when no chunk has room
+ *
+ * @return memory block address, or NULL if the heap is out of chunks or
+ *         align is not a power of two
+ */
+void *buddy_heap_alloc_aligned(buddy_heap_t *h, size_t size, size_t align)
+{
+    if(size > 1UL << h->max_order || align > 1UL << h->max_order ||
+       align == 0 || (align & (align - 1)) != 0)
+    {
+        return NULL;
+    }
+    
+    //Chunk i starts i chunks past the range and align is at most a chunk, so
+    //every chunk meets align exactly when the range does. Past this check a
+    //chunk fails only for want of a free block, and only then is one added.
+    
+    if(((unsigned long)h->memory & (align - 1)) != 0)
+    {
+        return NULL;
+    }
+    
+    for(;;)
+    {
+        heap_read_lock(h);
+        
+        void *addr = heap_try_alloc(h, size, align);
+        int nchunks = h->nchunks;
+        
+        heap_unlock(h);
+        
+        if(addr != NULL || heap_grow(h, nchunks) != 0)
+        {
+            return addr;
+        }
+    }
+}
+
+/**
+ * Allocate n blocks of the same size, adding chunks as needed
+ *
+ * @return number of blocks allocated, less than n if the heap ran out
+ */
+int buddy_heap_alloc_bulk(buddy_heap_t *h, size_t size, void **blocks, int n)
+{
+    int got = 0;
+    
+    if(size > 1UL << h->max_order)
+    {
+        return 0;
+    }
+    
+    for(;;)
+    {
+        heap_read_lock(h);
+        
+        for(int i = heap_next(h, h->room, 0); got < n && i < h->max_chunks;
+            i = heap_next(h, h->room, i + 1))
+        {
+            got += buddy_arena_alloc_bulk(h->chunks[i], size, blocks + got, n - got);
+            
+            if(got < n)
+            {
+                heap_full(h, i);
+            }
+        }
+        
+        int nchunks = h->nchunks;
+        
+        heap_unlock(h);
+        
+        if(got == n || heap_grow(h, nchunks) != 0)
+        {
+            return got;
+        }
+    }
+}
+
+/**
+ * Free a memory block to the chunk holding it, and release the chunk if
+ * that left all of it free
+ */
+void buddy_heap_free(buddy_heap_t *h, void *addr)
+{
+    if(addr == NULL)
+    {
+        return;
+    }
+    
+    int i = heap_chunk(h, addr);
+    
+    heap_read_lock(h);
+    
+    buddy_arena_t *a = h->chunks[i];
+    
+    buddy_arena_free(a, addr);
+    heap_room(h, i);
+    
+    int unused = chunk_freed(a);
+    
+    heap_unlock(h);
+    
+    if(unused && i != 0)
+    {
+        heap_release(h, i);
+    }
+}
+
+/**
+ * Free many blocks, a run of blocks of one chunk at a time. NULL entries are
+ * skipped, as buddy_heap_free() ignores NULL.
+ */
+void buddy_heap_free_bulk(buddy_heap_t *h, void **blocks, int n)
+{
+    for(int start = 0, end; start < n; start = end)
+    {
+        if(blocks[start] == NULL)
+        {
+            end = start + 1;
+            continue;
+        }
+        
+        int i = heap_chunk(h, blocks[start]);
+        
+        for(end = start + 1; end < n && blocks[end] != NULL && heap_chunk(h, blocks[end]) == i;
+            end++)
+        {
+        }
+        
+        heap_read_lock(h);
+        buddy_arena_free_bulk(h->chunks[i], blocks + start, end - start);
+        heap_room(h, i);
+        
+        int unused = chunk_freed(h->chunks[i]);
+        
+        heap_unlock(h);
+        
+        if(unused && i != 0)
+        {
+            heap_release(h, i);
+        }
+    }
+}
+
+/**
+ * Resize a block, within its chunk when possible and by moving it to
+ * another chunk otherwise
+ *
+ * @return address of the resized block, or NULL if there is no room; the old
+ *         block is then left untouched
+ */
+void *buddy_heap_realloc(buddy_heap_t *h, void *addr, size_t size)
+{
+    if(addr == NULL)
+    {
+        return buddy_heap_alloc(h, size);
+    }
+    
+    if(size == 0)
+    {
+        buddy_heap_free(h, addr);
+        return NULL;
+    }
+    
+    int i = heap_chunk(h, addr);
+    
+    heap_read_lock(h);
+    
+    //A block that moved within its chunk freed its old memory, which may
+    //have left the chunk unused once empty slabs are given back
+    
+    buddy_arena_t *a = h->chunks[i];
+    void *new_addr = buddy_arena_realloc(a, addr, size);
+    size_t old_size = new_addr == NULL ? block_size(a, addr) : 0;
+    
+    if(new_addr != NULL)
+    {
+        heap_room(h, i);
+    }
+    
+    int unused = new_addr != NULL && new_addr != addr && chunk_freed(a);
+    
+    heap_unlock(h);
+    
+    if(unused && i != 0)
+    {
+        heap_release(h, i);
+    }
+    
+    if(new_addr != NULL)
+    {
+        return new_addr;
+    }
+    
+    new_addr = buddy_heap_alloc(h, size);
+    
+    if(new_addr == NULL)
+    {
+        return NULL;
+    }
+    
+    memcpy(new_addr, addr, old_size < size ? old_size : size);
+    buddy_heap_free(h, addr);
+    
+    return new_addr;
+}
+
+/**
+ * Does an address lie in the heap's reserved range?
+ */
+int buddy_heap_owns(buddy_heap_t *h, const void *addr)
+{
+    return (const char *)addr >= h->memory &&
+        (size_t)((const char *)addr - h->memory) < (size_t)h->max_chunks << h->max_order;
+}
+
+/**
+ * Usable size of an allocated block of the heap
+ */
+size_t buddy_heap_block_size(buddy_heap_t *h, void *addr)
+{
+    heap_read_lock(h);
+    
+    size_t size = block_size(h->chunks[heap_chunk(h, addr)], addr);
+    
+    heap_unlock(h);
+    
+    return size;
+}
+
+/**
+ * Stop every other thread from using the heap until
+ * buddy_heap_postfork_parent() or buddy_heap_postfork_child(), for a
+ * pthread_atfork() prepare handler. Arena and slab locks are only taken with
+ * the heap lock held shared, so none of them is held across the fork.
+ */
+void buddy_heap_prefork(buddy_heap_t *h)
+{
+    heap_write_lock(h);
+}
+
+/**
+ * Let other threads use the heap again, in the parent after fork()
+ */
+void buddy_heap_postfork_parent(buddy_heap_t *h)
+{
+    heap_unlock(h);
+}
+
+/**
+ * Make the heap usable in the child after fork(). The lock was taken by a
+ * thread of the parent, so rather than being unlocked it is made anew.
+ */
+void buddy_heap_postfork_child(buddy_heap_t *h)
+{
+    if(h->flags & BUDDY_CONCURRENT)
+    {
+        pthread_rwlock_init(&h->lock, NULL);
+    }
+}
+
+/**
+ * Number of chunks currently mapped
+ */
+int buddy_heap_chunks(buddy_heap_t *h)
+{
+    return __atomic_load_n(&h->nchunks, __ATOMIC_RELAXED);
+}
+
+/**
+ * Print the free blocks of every chunk, one line per chunk
+ */
+void buddy_heap_dump(buddy_heap_t *h)
+{
+    heap_read_lock(h);
+    
+    for(int i = heap_next(h, h->mapped, 0); i < h->max_chunks; i = heap_next(h, h->mapped, i + 1))
+    {
+        buddy_arena_dump(h->chunks[i]);
+    }
+    
+    heap_unlock(h);
+}
+
+/**
+ * Print the status of the default heap
+ */
+void buddy_dump()
+{
+    buddy_heap_dump(g_heap);
+}
+
+void printStats()
+{
+    printf("MIN ORDER: %d\n", MIN_ORDER);
+    printf("MAX ORDER: %d\n", MAX_ORDER);
+    printf("PAGE SIZE: %d\n", PAGE_SIZE);
+    printf("MEMORY AREA: %lu\n", MEMORY_AREA);
+    printf("PAGE NUM: %lu\n", PAGE_NUM);
+
 }
@@ -1,10 +1,99 @@
 #ifndef BUDDY_H
 #define BUDDY_H
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * An independent buddy allocator over one region of memory
+ */
+typedef struct buddy_arena buddy_arena_t;
+
+/**
+ * A growable heap of buddy arenas, one per fixed-size chunk
+ */
+typedef struct buddy_heap buddy_heap_t;
+
+/* flags for buddy_arena_create() and buddy_heap_create() */
+#define BUDDY_CONCURRENT 0x1    ///< Lock each order so any thread may use the arena
+#define BUDDY_LOCKFREE 0x2      ///< Keep freed min_order blocks on a lock-free stack
+#define BUDDY_SLAB 0x4          ///< Serve small requests from slabs of fixed-size objects
+#define BUDDY_EXACT 0x8         ///< Give the pages past the end of each request back to the free areas
+#define BUDDY_HUGEPAGE 0x10     ///< Back a mapped region with huge pages
+
+/**
+ * Arena statistics, filled in by buddy_arena_stats()
+ */
+typedef struct buddy_stats {
+    size_t free_bytes;          ///< Bytes in blocks on the free areas
+    unsigned long nsplit;       ///< Blocks split in two since the arena was reset
+    unsigned long nmerge;       ///< Buddy pairs merged on the free areas since the arena was reset
+    size_t purged_bytes;        ///< Bytes handed back to the kernel by purging
+    size_t meta_bytes;          ///< Bytes of bookkeeping: the arena, its free areas and page descriptors
+} buddy_stats_t;
+
+/**
+ * How an arena serves a request of some size, filled in by
+ * buddy_arena_size_class()
+ */
+typedef struct buddy_class {
+    int order;                  ///< Order of the block taken, or of the slab block; max_order + 1 if too large
+    int slab;                   ///< Slab size class of the request, -1 if it takes a buddy block
+    size_t usable;              ///< Bytes the request may use: the object or block size, 0 if too large
+} buddy_class_t;
+
+int buddy_size_order(size_t size, int min_order);
+
+buddy_arena_t *buddy_arena_create(void *region, size_t size, int min_order, int max_order,
+                                  unsigned flags);
+void buddy_arena_destroy(buddy_arena_t *arena);
+void buddy_arena_reset(buddy_arena_t *arena);
+void *buddy_arena_alloc(buddy_arena_t *arena, size_t size);
+void *buddy_arena_alloc_aligned(buddy_arena_t *arena, size_t size, size_t align);
+int buddy_arena_alloc_bulk(buddy_arena_t *arena, size_t size, void **blocks, int n);
+void buddy_arena_free(buddy_arena_t *arena, void *addr);
+void *buddy_arena_realloc(buddy_arena_t *arena, void *addr, size_t size);
+void buddy_arena_free_bulk(buddy_arena_t *arena, void **blocks, int n);
+void buddy_arena_dump(buddy_arena_t *arena);
+int buddy_arena_set_pcp(buddy_arena_t *arena, int low, int high, int batch);
+void buddy_arena_drain(buddy_arena_t *arena);
+int buddy_arena_set_lazy(buddy_arena_t *arena, int threshold);
+int buddy_arena_set_purge(buddy_arena_t *arena, int order, unsigned decay_ms, int lazy_free);
+size_t buddy_arena_purge(buddy_arena_t *arena);
+void buddy_arena_stats(buddy_arena_t *arena, buddy_stats_t *stats);
+void buddy_arena_size_class(buddy_arena_t *arena, size_t size, buddy_class_t *cls);
+
+buddy_heap_t *buddy_heap_create(int min_order, int max_order, int max_chunks, unsigned flags);
+void buddy_heap_destroy(buddy_heap_t *heap);
+void buddy_heap_reset(buddy_heap_t *heap);
+void *buddy_heap_alloc(buddy_heap_t *heap, size_t size);
+void *buddy_heap_alloc_aligned(buddy_heap_t *heap, size_t size, size_t align);
+int buddy_heap_alloc_bulk(buddy_heap_t *heap, size_t size, void **blocks, int n);
+void buddy_heap_free(buddy_heap_t *heap, void *addr);
+void buddy_heap_free_bulk(buddy_heap_t *heap, void **blocks, int n);
+void *buddy_heap_realloc(buddy_heap_t *heap, void *addr, size_t size);
+int buddy_heap_owns(buddy_heap_t *heap, const void *addr);
+size_t buddy_heap_block_size(buddy_heap_t *heap, void *addr);
+int buddy_heap_chunks(buddy_heap_t *heap);
+void buddy_heap_prefork(buddy_heap_t *heap);
+void buddy_heap_postfork_parent(buddy_heap_t *heap);
+void buddy_heap_postfork_child(buddy_heap_t *heap);
+void buddy_heap_dump(buddy_heap_t *heap);
+
 void buddy_init();
-void *buddy_alloc(int size);
+void *buddy_alloc(size_t size);
+int buddy_alloc_bulk(size_t size, void **blocks, int n);
 void buddy_free(void *addr);
+void *buddy_realloc(void *addr, size_t size);
+void buddy_free_bulk(void **blocks, int n);
 void buddy_dump();
 void printStats();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // BUDDY_H
@@ -0,0 +1,412 @@
+#ifndef BUDDY_HPP
+#define BUDDY_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include <sys/mman.h>
+
+#include "buddy.h"
+
+/**
+ * A std::pmr::memory_resource handing out blocks of a buddy arena
+ *
+ * The resource either wraps an arena the caller owns or creates, maps and
+ * destroys one of its own. Blocks are aligned as buddy_arena_alloc_aligned()
+ * aligns them: an arena of its own starts on a boundary of its size, while an
+ * alignment the start of a caller's region lacks cannot be met. An allocation
+ * that fails throws std::bad_alloc.
+ */
+class BuddyResource : public std::pmr::memory_resource {
+public:
+    /**
+     * Allocate from an existing arena, which must outlive the resource
+     */
+    explicit BuddyResource(buddy_arena_t *arena) noexcept : arena_(arena), owned_(false) {}
+
+    /**
+     * Allocate from a mapped arena of its own
+     *
+     * @param size size of the arena in bytes
+     * @param min_order order of the smallest block
+     * @param max_order order of the largest block
+     * @param flags BUDDY_* flags for buddy_arena_create()
+     */
+    BuddyResource(std::size_t size, int min_order, int max_order, unsigned flags = BUDDY_SLAB)
+        : arena_(buddy_arena_create(nullptr, size, min_order, max_order, flags)), owned_(true)
+    {
+        if (arena_ == nullptr)
+            throw std::bad_alloc();
+    }
+
+    BuddyResource(const BuddyResource &) = delete;
+    BuddyResource &operator=(const BuddyResource &) = delete;
+
+    ~BuddyResource() override
+    {
+        if (owned_)
+            buddy_arena_destroy(arena_);
+    }
+
+    /**
+     * The arena behind the resource
+     */
+    buddy_arena_t *arena() const noexcept { return arena_; }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void *p = buddy_arena_alloc_aligned(arena_, bytes, alignment);
+
+        if (p == nullptr)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    // A block's size is recorded in its page state, so the size and
+    // alignment given back are not needed to free it
+    void do_deallocate(void *p, std::size_t, std::size_t) override
+    {
+        buddy_arena_free(arena_, p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        auto *o = dynamic_cast<const BuddyResource *>(&other);
+
+        return o != nullptr && o->arena_ == arena_;
+    }
+
+private:
+    buddy_arena_t *arena_;      ///< Arena the blocks come from
+    bool owned_;                ///< Destroy the arena with the resource?
+};
+
+/**
+ * A standard allocator over a BuddyResource, for containers that take an
+ * allocator type rather than a std::pmr one
+ *
+ * Copies share the resource, which must outlive every container using it.
+ */
+template <class T>
+class BuddyAllocator {
+public:
+    using value_type = T;
+
+    explicit BuddyAllocator(BuddyResource *resource) noexcept : resource_(resource) {}
+
+    template <class U>
+    BuddyAllocator(const BuddyAllocator<U> &other) noexcept : resource_(other.resource()) {}
+
+    T *allocate(std::size_t n)
+    {
+        if (n > std::size_t(-1) / sizeof(T))
+            throw std::bad_array_new_length();
+        return static_cast<T *>(resource_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept
+    {
+        resource_->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    /**
+     * The resource the blocks come from
+     */
+    BuddyResource *resource() const noexcept { return resource_; }
+
+    template <class U>
+    bool operator==(const BuddyAllocator<U> &other) const noexcept
+    {
+        return resource_ == other.resource();
+    }
+
+    template <class U>
+    bool operator!=(const BuddyAllocator<U> &other) const noexcept
+    {
+        return !(*this == other);
+    }
+
+private:
+    BuddyResource *resource_;   ///< Resource the blocks come from
+};
+
+/**
+ * A buddy allocator whose orders are fixed at compile time
+ *
+ * buddy_arena_t reads its orders from the arena on every call. Here they are
+ * template parameters, so one program can hold arenas of several shapes and
+ * each one compiles to straight-line code. A size maps to an order through a
+ * constexpr table indexed by its bit width. The split and merge chains of
+ * each order are unrolled, and a table of per-order functions picks the
+ * chain to run.
+ *
+ * The arena manages 1 << MaxOrder bytes, either a region the caller owns or
+ * one it maps itself. Blocks are aligned to their size counted from the start
+ * of the region. Free list links live in the free blocks, and the one byte of
+ * state per page lives in the object, so large instantiations belong on the
+ * heap rather than the stack. The arena takes no locks.
+ */
+template <int MinOrder, int MaxOrder>
+class BuddyArena {
+    static_assert(MinOrder >= 4, "a free block must hold its list links");
+    static_assert(MaxOrder >= MinOrder && MaxOrder - MinOrder <= 24,
+                  "the page states are kept in the object");
+    static_assert(MaxOrder < 64, "blocks are sized with a std::size_t");
+
+public:
+    static constexpr int orders = MaxOrder - MinOrder + 1;
+    static constexpr std::size_t region_size = std::size_t(1) << MaxOrder;
+    static constexpr std::size_t page_num = region_size >> MinOrder;
+
+    /**
+     * Manage a region of region_size bytes, which must outlive the arena
+     */
+    explicit BuddyArena(void *region) noexcept
+        : memory_(static_cast<char *>(region)), owned_(false)
+    {
+        reset();
+    }
+
+    /**
+     * Manage a mapped region of its own
+     */
+    BuddyArena() : owned_(true)
+    {
+        void *region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (region == MAP_FAILED)
+            throw std::bad_alloc();
+        memory_ = static_cast<char *>(region);
+        reset();
+    }
+
+    BuddyArena(const BuddyArena &) = delete;
+    BuddyArena &operator=(const BuddyArena &) = delete;
+
+    ~BuddyArena()
+    {
+        if (owned_)
+            munmap(memory_, region_size);
+    }
+
+    /**
+     * The order of the smallest block holding size bytes
+     *
+     * @return the order, or MaxOrder + 1 if no block is large enough
+     */
+    static constexpr int order_of(std::size_t size) noexcept
+    {
+        // ceil(log2(size)) is the bit width of size - 1
+        std::size_t n = size > 1 ? size - 1 : 1;
+
+        return order_table_[64 - __builtin_clzll(n)];
+    }
+
+    /**
+     * Free every block, leaving one block of MaxOrder
+     */
+    void reset() noexcept
+    {
+        free_mask_ = 0;
+        for (Link &head : areas_)
+            head.next = head.prev = &head;
+        std::memset(states_, 0, sizeof(states_));
+        push(MaxOrder, memory_);
+    }
+
+    /**
+     * Allocate a block of at least size bytes
+     *
+     * @return the block, or nullptr if no free block is large enough
+     */
+    void *alloc(std::size_t size) noexcept
+    {
+        int order = order_of(size);
+
+        if (order > MaxOrder)
+            return nullptr;
+        return alloc_fns_[order - MinOrder](this);
+    }
+
+    /**
+     * Free a block returned by alloc(); nullptr is ignored
+     */
+    void free(void *addr) noexcept
+    {
+        if (addr == nullptr)
+            return;
+
+        char *block = static_cast<char *>(addr);
+
+        free_fns_[states_[page(block)] - MinOrder](this, block);
+    }
+
+    /**
+     * Bytes in blocks on the free lists
+     */
+    std::size_t free_bytes() const noexcept
+    {
+        std::size_t bytes = 0;
+
+        for (int o = MinOrder; o <= MaxOrder; o++) {
+            const Link *head = &areas_[o - MinOrder];
+
+            for (const Link *l = head->next; l != head; l = l->next)
+                bytes += std::size_t(1) << o;
+        }
+        return bytes;
+    }
+
+    /**
+     * The region the blocks come from
+     */
+    void *memory() const noexcept { return memory_; }
+
+private:
+    /**
+     * Links of a free block, kept in its first bytes
+     */
+    struct Link {
+        Link *next;
+        Link *prev;
+    };
+
+    // state of a block's first page while the block is on a free list
+    enum : unsigned char { FREE = 0x80 };
+
+    using AllocFn = void *(*)(BuddyArena *);
+    using FreeFn = void (*)(BuddyArena *, char *);
+
+    std::size_t page(const char *block) const noexcept
+    {
+        return std::size_t(block - memory_) >> MinOrder;
+    }
+
+    void push(int order, char *block) noexcept
+    {
+        Link *head = &areas_[order - MinOrder];
+        Link *l = reinterpret_cast<Link *>(block);
+
+        l->next = head->next;
+        l->prev = head;
+        head->next->prev = l;
+        head->next = l;
+        states_[page(block)] = FREE | order;
+        free_mask_ |= std::uint64_t(1) << (order - MinOrder);
+    }
+
+    void remove(int order, char *block) noexcept
+    {
+        Link *head = &areas_[order - MinOrder];
+        Link *l = reinterpret_cast<Link *>(block);
+
+        l->prev->next = l->next;
+        l->next->prev = l->prev;
+        if (head->next == head)
+            free_mask_ &= ~(std::uint64_t(1) << (order - MinOrder));
+    }
+
+    /**
+     * Put the upper halves of a block of order from, split down to Order,
+     * on their free lists
+     */
+    template <int O, int Order>
+    void split(char *block, int from) noexcept
+    {
+        if constexpr (O > Order) {
+            if (O <= from)
+                push(O - 1, block + (std::size_t(1) << (O - 1)));
+            split<O - 1, Order>(block, from);
+        }
+    }
+
+    /**
+     * Take the smallest free block of at least Order and split it down
+     */
+    template <int Order>
+    static void *alloc_order(BuddyArena *a) noexcept
+    {
+        std::uint64_t avail = a->free_mask_ >> (Order - MinOrder);
+
+        if (avail == 0)
+            return nullptr;
+
+        int from = Order + __builtin_ctzll(avail);
+        char *block = reinterpret_cast<char *>(a->areas_[from - MinOrder].next);
+
+        a->remove(from, block);
+        a->template split<MaxOrder, Order>(block, from);
+        a->states_[a->page(block)] = Order;
+        return block;
+    }
+
+    /**
+     * Coalesce a block of order O with its buddy for as long as the buddy is
+     * free, then put the result on its free list
+     */
+    template <int O>
+    void merge(char *block) noexcept
+    {
+        if constexpr (O < MaxOrder) {
+            char *buddy = memory_ + (std::size_t(block - memory_) ^ (std::size_t(1) << O));
+
+            if (states_[page(buddy)] == (FREE | O)) {
+                remove(O, buddy);
+                if (buddy < block)
+                    std::swap(block, buddy);
+                states_[page(buddy)] = 0;
+                merge<O + 1>(block);
+                return;
+            }
+        }
+        push(O, block);
+    }
+
+    template <int Order>
+    static void free_order(BuddyArena *a, char *block) noexcept
+    {
+        a->template merge<Order>(block);
+    }
+
+    static constexpr std::array<signed char, 65> make_order_table() noexcept
+    {
+        std::array<signed char, 65> table{};
+
+        for (int width = 0; width <= 64; width++)
+            table[width] = width < MinOrder ? MinOrder : width > MaxOrder ? MaxOrder + 1 : width;
+        return table;
+    }
+
+    template <std::size_t... I>
+    static constexpr std::array<AllocFn, orders> make_alloc_fns(std::index_sequence<I...>) noexcept
+    {
+        return {{&alloc_order<MinOrder + int(I)>...}};
+    }
+
+    template <std::size_t... I>
+    static constexpr std::array<FreeFn, orders> make_free_fns(std::index_sequence<I...>) noexcept
+    {
+        return {{&free_order<MinOrder + int(I)>...}};
+    }
+
+    static constexpr std::array<signed char, 65> order_table_ = make_order_table();
+    static constexpr std::array<AllocFn, orders> alloc_fns_ =
+        make_alloc_fns(std::make_index_sequence<orders>());
+    static constexpr std::array<FreeFn, orders> free_fns_ =
+        make_free_fns(std::make_index_sequence<orders>());
+
+    char *memory_;                      ///< Start of the region
+    bool owned_;                        ///< Unmap the region with the arena?
+    std::uint64_t free_mask_;           ///< Bit o - MinOrder set while order o has free blocks
+    Link areas_[orders];                ///< Circular free list of each order, headed by a sentinel
+    unsigned char states_[page_num];    ///< Order of each block's first page, | FREE while free
+};
+
+#endif // BUDDY_HPP
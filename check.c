@@ -0,0 +1,499 @@
+/**
+ * Allocator Checks
+ *
+ * Runs random allocation traffic through arenas in each mode and checks the
+ * results: every block lies in the region, is aligned as asked, and keeps its
+ * contents until it is freed or resized, and once everything is freed and the
+ * caches drained the free areas hold the whole region again. Prints one line
+ * per mode and exits with failure on the first broken check. Heaps get the
+ * same traffic. Run a subset by naming the modes on the command line, e.g.
+ * `./check slab heap`.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buddy.h"
+
+/* live blocks each thread of a run juggles */
+#define SLOTS 512
+
+/* operations each thread of a run performs */
+#define ITERS 50000
+
+/* threads of a run in a BUDDY_CONCURRENT arena */
+#define THREADS 4
+
+/* order of a page, and of the largest block in an arena by default */
+#define MIN_ORDER 12
+#define MAX_ORDER 26
+
+/**
+ * Exit with failure, naming the check and the mode, if cond does not hold
+ */
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "check: %s: %s:%d: %s\n",	\
+				current, __FILE__, __LINE__, #cond);	\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+/**
+ * An arena configuration to check
+ */
+typedef struct check_mode_t {
+	const char *name;	///< Name used to select the mode
+	unsigned flags;		///< BUDDY_* flags for buddy_arena_create()
+	size_t size;		///< Region size; a multiple of the page size
+	int max_order;		///< Order of the largest block, 0 for MAX_ORDER
+	int pcp;		///< Turn on per-CPU caches?
+	int lazy;		///< Lazy coalescing threshold, 0 for none
+	int purge;		///< Purge chunk order, 0 for none
+	int mapped;		///< Let the arena map its own region?
+} check_mode_t;
+
+/**
+ * A live block and what was written to it
+ */
+typedef struct slot_t {
+	unsigned char *addr;	///< The block, NULL if the slot is empty
+	size_t size;		///< Bytes requested and written
+	unsigned char fill;	///< Byte the block was filled with
+} slot_t;
+
+/**
+ * One thread's share of a run
+ */
+typedef struct run_t {
+	buddy_arena_t *arena;	///< Arena every thread allocates from
+	char *region;		///< Start of the arena's region
+	size_t size;		///< Size of the region
+	unsigned seed;		///< Random state of the thread
+	slot_t slots[SLOTS];	///< The thread's live blocks
+} run_t;
+
+/* name of the mode being checked, for failure messages */
+static const char *current;
+
+static const check_mode_t modes[] = {
+	{ .name = "plain", .size = 1UL << MAX_ORDER },
+	{ .name = "mapped", .size = 1UL << MAX_ORDER, .mapped = 1 },
+	{ .name = "hugepage", .flags = BUDDY_HUGEPAGE, .size = 1UL << MAX_ORDER, .mapped = 1 },
+	{ .name = "big", .size = 1UL << 33, .max_order = 33, .mapped = 1 },
+	{ .name = "huge", .size = 1UL << 40, .max_order = 40, .mapped = 1 },
+	{ .name = "npot", .size = (1UL << MAX_ORDER) - (37UL << MIN_ORDER) },
+	{ .name = "concurrent", .flags = BUDDY_CONCURRENT, .size = 1UL << MAX_ORDER },
+	{ .name = "pcp", .flags = BUDDY_CONCURRENT, .size = 1UL << MAX_ORDER, .pcp = 1 },
+	{ .name = "lockfree", .flags = BUDDY_CONCURRENT | BUDDY_LOCKFREE, .size = 1UL << MAX_ORDER,
+	  .mapped = 1 },
+	{ .name = "slab", .flags = BUDDY_SLAB, .size = 1UL << MAX_ORDER },
+	{ .name = "slab_concurrent", .flags = BUDDY_CONCURRENT | BUDDY_SLAB, .size = 1UL << MAX_ORDER,
+	  .pcp = 1 },
+	{ .name = "exact", .flags = BUDDY_EXACT, .size = 1UL << MAX_ORDER },
+	{ .name = "exact_slab", .flags = BUDDY_EXACT | BUDDY_SLAB, .size = 1UL << MAX_ORDER },
+	{ .name = "exact_npot", .flags = BUDDY_EXACT | BUDDY_SLAB,
+	  .size = (3UL << (MAX_ORDER - 2)) + (5UL << MIN_ORDER) },
+	{ .name = "lazy", .size = 1UL << MAX_ORDER, .lazy = 4 },
+	{ .name = "lazy_concurrent", .flags = BUDDY_CONCURRENT | BUDDY_LOCKFREE, .size = 1UL << MAX_ORDER,
+	  .pcp = 1, .lazy = 8 },
+	{ .name = "purge", .size = 1UL << MAX_ORDER, .purge = 16, .mapped = 1 },
+	{ .name = "purge_concurrent", .flags = BUDDY_CONCURRENT, .size = 1UL << MAX_ORDER, .lazy = 2,
+	  .purge = 16 },
+	{ .name = "purge_npot", .flags = BUDDY_CONCURRENT, .size = (1UL << MAX_ORDER) - (3UL << MIN_ORDER),
+	  .lazy = 2, .purge = 16 },
+};
+
+static unsigned next_rand(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+/**
+ * A random request size: mostly small, some up to 64K, a few up to 1M
+ */
+static size_t rand_size(unsigned *seed)
+{
+	unsigned r = next_rand(seed);
+
+	if (r % 16 == 0)
+		return 1 + next_rand(seed) % (1 << 20);
+	if (r % 4 == 0)
+		return 1 + next_rand(seed) % (64 << 10);
+	return 1 + next_rand(seed) % 2048;
+}
+
+/**
+ * Check a block lies in the region, then fill its first size bytes
+ */
+static void fill(run_t *run, slot_t *slot, void *addr, size_t size)
+{
+	CHECK((char *)addr >= run->region && (char *)addr + size <= run->region + run->size);
+
+	slot->addr = addr;
+	slot->size = size;
+	slot->fill = next_rand(&run->seed) | 1;
+	memset(addr, slot->fill, size);
+}
+
+/**
+ * Check the first bytes of a block still hold what was written to them,
+ * every byte of the ends and a sample in between
+ */
+static void verify(slot_t *slot, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i += i < 64 || bytes - i <= 64 ? 1 : 61)
+		CHECK(slot->addr[i] == slot->fill);
+}
+
+/**
+ * Random traffic: allocate, resize and free single blocks, allocate blocks
+ * aligned to up to 64K, and allocate and free in bulk
+ */
+static void *traffic(void *arg)
+{
+	run_t *run = arg;
+	buddy_arena_t *a = run->arena;
+
+	for (int it = 0; it < ITERS; it++) {
+		unsigned r = next_rand(&run->seed);
+		slot_t *slot = &run->slots[r % SLOTS];
+
+		switch ((r >> 12) % 8) {
+		case 0:
+		case 1: {
+			// Resize: the contents up to the smaller size survive
+			if (slot->addr == NULL)
+				break;
+
+			size_t size = rand_size(&run->seed);
+			void *addr = buddy_arena_realloc(a, slot->addr, size);
+
+			if (addr == NULL) {
+				verify(slot, slot->size);
+				break;
+			}
+
+			slot->addr = addr;
+			verify(slot, slot->size < size ? slot->size : size);
+			fill(run, slot, addr, size);
+			break;
+		}
+		case 2: {
+			// Aligned to a power of two from 1 to 64K
+			if (slot->addr != NULL)
+				break;
+
+			size_t size = rand_size(&run->seed);
+			size_t align = 1UL << (next_rand(&run->seed) % 17);
+			void *addr = buddy_arena_alloc_aligned(a, size, align);
+
+			if (addr != NULL) {
+				CHECK(((uintptr_t)addr & (align - 1)) == 0);
+				fill(run, slot, addr, size);
+			}
+			break;
+		}
+		case 3: {
+			// Bulk: allocate into the empty slots of a run, free the full ones
+			int first = r % (SLOTS - 8);
+			void *blocks[8];
+			int n = 0;
+
+			for (int i = first; i < first + 8; i++) {
+				if (run->slots[i].addr != NULL) {
+					verify(&run->slots[i], run->slots[i].size);
+					blocks[n++] = run->slots[i].addr;
+					run->slots[i].addr = NULL;
+				}
+			}
+
+			if (n > 0) {
+				buddy_arena_free_bulk(a, blocks, n);
+				break;
+			}
+
+			size_t size = rand_size(&run->seed);
+
+			n = buddy_arena_alloc_bulk(a, size, blocks, 8);
+			for (int i = 0; i < n; i++)
+				fill(run, &run->slots[first + i], blocks[i], size);
+			break;
+		}
+		default:
+			if (slot->addr != NULL) {
+				verify(slot, slot->size);
+				buddy_arena_free(a, slot->addr);
+				slot->addr = NULL;
+			} else {
+				size_t size = rand_size(&run->seed);
+				void *addr = buddy_arena_alloc(a, size);
+				buddy_class_t cls;
+
+				// Whatever the arena serves, its size class covers
+				buddy_arena_size_class(a, size, &cls);
+				if (addr != NULL) {
+					CHECK(cls.usable >= size);
+					fill(run, slot, addr, size);
+				}
+			}
+			break;
+		}
+	}
+
+	for (int i = 0; i < SLOTS; i++) {
+		if (run->slots[i].addr != NULL) {
+			verify(&run->slots[i], run->slots[i].size);
+			buddy_arena_free(a, run->slots[i].addr);
+			run->slots[i].addr = NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Check that, once the caches are drained, the free areas hold the whole
+ * region and that, in a power-of-two arena, it has merged back into one block
+ */
+static void check_whole(buddy_arena_t *a, char *region, size_t size)
+{
+	buddy_stats_t stats;
+
+	buddy_arena_drain(a);
+	buddy_arena_stats(a, &stats);
+	CHECK(stats.free_bytes == size);
+
+	if ((size & (size - 1)) == 0) {
+		CHECK(buddy_arena_alloc(a, size) == region);
+		buddy_arena_free(a, region);
+	}
+}
+
+/**
+ * Run traffic through a fresh arena of a mode, from several threads if it
+ * is concurrent, and check it is whole again afterwards, then again after a
+ * reset
+ */
+static void check_mode(const check_mode_t *m)
+{
+	static run_t runs[THREADS];
+	pthread_t threads[THREADS];
+	int nthreads = (m->flags & BUDDY_CONCURRENT) ? THREADS : 1;
+	int max_order = m->max_order ? m->max_order : MAX_ORDER;
+	char *region = NULL;
+
+	current = m->name;
+	if (!m->mapped)
+		CHECK(posix_memalign((void **)&region, 1UL << max_order, m->size) == 0);
+
+	buddy_arena_t *a = buddy_arena_create(region, m->size, MIN_ORDER, max_order, m->flags);
+
+	CHECK(a != NULL);
+	if (m->pcp)
+		CHECK(buddy_arena_set_pcp(a, 4, 16, 8) == 0);
+	if (m->lazy)
+		CHECK(buddy_arena_set_lazy(a, m->lazy) == 0);
+	if (m->purge)
+		CHECK(buddy_arena_set_purge(a, m->purge, 1, 0) == 0);
+
+	// A mapped region starts at the first block of the fresh arena, aligned
+	// in memory to the largest block
+	if (m->mapped) {
+		region = buddy_arena_alloc(a, m->size);
+		CHECK(region != NULL);
+		CHECK(((uintptr_t)region & ((1UL << max_order) - 1)) == 0);
+		buddy_arena_free(a, region);
+	}
+	check_whole(a, region, m->size);
+
+	// The upper half starts past 4G in a big arena
+	if ((m->size & (m->size - 1)) == 0) {
+		char *lo = buddy_arena_alloc(a, m->size / 2);
+		char *hi = buddy_arena_alloc(a, m->size / 2);
+
+		CHECK(lo == region && hi == region + m->size / 2);
+		hi[m->size / 2 - 1] = 1;
+		buddy_arena_free(a, hi);
+		buddy_arena_free(a, lo);
+		check_whole(a, region, m->size);
+	}
+
+	// Zero bytes still take a block, plain and aligned past one page
+	void *zero = buddy_arena_alloc(a, 0);
+	void *zero_aligned = buddy_arena_alloc_aligned(a, 0, 4UL << MIN_ORDER);
+
+	CHECK(zero != NULL && zero_aligned != NULL);
+	CHECK(((uintptr_t)zero_aligned & ((4UL << MIN_ORDER) - 1)) == 0);
+	buddy_arena_free(a, zero_aligned);
+	buddy_arena_free(a, zero);
+	check_whole(a, region, m->size);
+
+	// Small aligned requests share a slab rather than taking a block each
+	if (m->flags & BUDDY_SLAB) {
+		buddy_stats_t before, after;
+		void *first = buddy_arena_alloc_aligned(a, 64, 64);
+
+		buddy_arena_stats(a, &before);
+
+		void *second = buddy_arena_alloc_aligned(a, 40, 64);
+
+		buddy_arena_stats(a, &after);
+		CHECK(((uintptr_t)first & 63) == 0 && ((uintptr_t)second & 63) == 0);
+		CHECK(after.free_bytes == before.free_bytes);
+		buddy_arena_free(a, second);
+		buddy_arena_free(a, first);
+		check_whole(a, region, m->size);
+	}
+
+	for (int round = 0; round < 2; round++) {
+		for (int t = 0; t < nthreads; t++) {
+			memset(&runs[t], 0, sizeof(runs[t]));
+			runs[t].arena = a;
+			runs[t].region = region;
+			runs[t].size = m->size;
+			runs[t].seed = 1 + t + round * THREADS;
+			CHECK(pthread_create(&threads[t], NULL, traffic, &runs[t]) == 0);
+		}
+		for (int t = 0; t < nthreads; t++)
+			pthread_join(threads[t], NULL);
+
+		check_whole(a, region, m->size);
+		buddy_arena_reset(a);
+		check_whole(a, region, m->size);
+	}
+
+	buddy_arena_destroy(a);
+	if (!m->mapped)
+		free(region);
+	printf("check: %-16s ok\n", m->name);
+}
+
+/**
+ * Heap traffic: allocate, resize and free, checking contents, then free
+ * what is left in bulk
+ */
+static void *heap_traffic(void *arg)
+{
+	buddy_heap_t *h = arg;
+	static __thread slot_t slots[SLOTS];
+	unsigned seed = (uintptr_t)&slots;
+
+	for (int it = 0; it < ITERS; it++) {
+		unsigned r = next_rand(&seed);
+		slot_t *slot = &slots[r % SLOTS];
+
+		if (slot->addr != NULL) {
+			for (size_t i = 0; i < slot->size; i += 61)
+				CHECK(slot->addr[i] == slot->fill);
+
+			if ((r >> 12) % 4 == 0) {
+				size_t size = rand_size(&seed);
+				unsigned char *addr = buddy_heap_realloc(h, slot->addr, size);
+
+				CHECK(addr != NULL);
+				slot->addr = addr;
+				slot->size = size;
+				memset(addr, slot->fill, size);
+				continue;
+			}
+
+			buddy_heap_free(h, slot->addr);
+			slot->addr = NULL;
+		} else if ((r >> 12) % 4 == 1) {
+			// Aligned to a power of two from 1 to a whole chunk
+			size_t align = 1UL << (next_rand(&seed) % 23);
+
+			slot->size = rand_size(&seed);
+			slot->addr = buddy_heap_alloc_aligned(h, slot->size, align);
+			slot->fill = r | 1;
+			CHECK(slot->addr != NULL);
+			CHECK(((uintptr_t)slot->addr & (align - 1)) == 0);
+			memset(slot->addr, slot->fill, slot->size);
+		} else {
+			slot->size = rand_size(&seed);
+			slot->addr = buddy_heap_alloc(h, slot->size);
+			slot->fill = r | 1;
+			CHECK(slot->addr != NULL);
+			memset(slot->addr, slot->fill, slot->size);
+		}
+	}
+
+	// Free the lot in one call, empty slots included as NULL
+	void *blocks[SLOTS];
+
+	for (int i = 0; i < SLOTS; i++) {
+		blocks[i] = slots[i].addr;
+		slots[i].addr = NULL;
+	}
+	buddy_heap_free_bulk(h, blocks, SLOTS);
+
+	return NULL;
+}
+
+/**
+ * Run heap traffic from several threads
+ */
+static void check_heap(unsigned flags, const char *name)
+{
+	pthread_t threads[THREADS];
+
+	current = name;
+
+	buddy_heap_t *h = buddy_heap_create(MIN_ORDER, 22, 256, flags);
+
+	CHECK(h != NULL);
+
+	// A chunk-aligned block with the first chunk in use takes a new chunk
+	void *small = buddy_heap_alloc(h, 1);
+	void *whole = buddy_heap_alloc_aligned(h, 1UL << 22, 1UL << 22);
+
+	CHECK(small != NULL && whole != NULL && buddy_heap_chunks(h) == 2);
+	CHECK(((uintptr_t)whole & ((1UL << 22) - 1)) == 0);
+	buddy_heap_free(h, whole);
+	buddy_heap_free(h, small);
+
+	for (int t = 0; t < THREADS; t++)
+		CHECK(pthread_create(&threads[t], NULL, heap_traffic, h) == 0);
+	for (int t = 0; t < THREADS; t++)
+		pthread_join(threads[t], NULL);
+
+	// Emptied chunks are released, all but the first chunk and one spare
+	CHECK(buddy_heap_chunks(h) <= 2);
+	buddy_heap_destroy(h);
+	printf("check: %-16s ok\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	size_t nmodes = sizeof(modes) / sizeof(modes[0]);
+
+	for (size_t i = 0; i < nmodes; i++) {
+		int selected = (argc == 1);
+
+		for (int a = 1; a < argc; a++)
+			if (strcmp(argv[a], modes[i].name) == 0)
+				selected = 1;
+
+		if (selected)
+			check_mode(&modes[i]);
+	}
+
+	int heap = (argc == 1);
+
+	for (int a = 1; a < argc; a++)
+		if (strcmp(argv[a], "heap") == 0)
+			heap = 1;
+
+	if (heap) {
+		check_heap(BUDDY_CONCURRENT, "heap");
+		check_heap(BUDDY_CONCURRENT | BUDDY_SLAB, "heap_slab");
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,224 @@
+/**
+ * Malloc Checks
+ *
+ * Runs random traffic through the C allocation functions from several
+ * threads and checks the results: every block is aligned as asked, at least
+ * as large as asked, zeroed by calloc(), and keeps its contents until it is
+ * freed or resized. It also forks while the threads run, and checks the
+ * child can allocate. `make test` runs it under LD_PRELOAD=./libbuddy.so and
+ * names the library, e.g. `./check_malloc libbuddy.so`, to check malloc()
+ * really comes from it.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* live blocks each thread juggles */
+#define SLOTS 512
+
+/* operations each thread performs */
+#define ITERS 50000
+
+/* threads of the run */
+#define THREADS 4
+
+/* forks made while the threads run */
+#define FORKS 20
+
+/**
+ * Exit with failure, naming the check, if cond does not hold
+ */
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "check_malloc: %s:%d: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+/**
+ * A live block and what was written to it
+ */
+typedef struct slot_t {
+	unsigned char *addr;	///< The block, NULL if the slot is empty
+	size_t size;		///< Bytes requested and written
+	unsigned char fill;	///< Byte the block was filled with
+} slot_t;
+
+static unsigned next_rand(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+/**
+ * A random request size: mostly small, some up to 64K, a few up to 2M, past
+ * the largest block the heap serves
+ */
+static size_t rand_size(unsigned *seed)
+{
+	unsigned r = next_rand(seed);
+
+	if (r % 32 == 0)
+		return 1 + next_rand(seed) % (2 << 20);
+	if (r % 4 == 0)
+		return 1 + next_rand(seed) % (64 << 10);
+	return 1 + next_rand(seed) % 2048;
+}
+
+/**
+ * Check a new block is large enough, then fill its first size bytes
+ */
+static void fill(slot_t *slot, void *addr, size_t size, unsigned *seed)
+{
+	CHECK(addr != NULL);
+	CHECK(malloc_usable_size(addr) >= size);
+
+	slot->addr = addr;
+	slot->size = size;
+	slot->fill = next_rand(seed) | 1;
+	memset(addr, slot->fill, size);
+}
+
+/**
+ * Check the first bytes of a block still hold what was written to them,
+ * every byte of the ends and a sample in between
+ */
+static void verify(slot_t *slot, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i += i < 64 || bytes - i <= 64 ? 1 : 61)
+		CHECK(slot->addr[i] == slot->fill);
+}
+
+/**
+ * Random traffic: malloc, calloc, the aligned allocators, realloc and free
+ */
+static void *traffic(void *arg)
+{
+	unsigned seed = (uintptr_t)arg;
+	slot_t *slots = calloc(SLOTS, sizeof(*slots));
+
+	CHECK(slots != NULL);
+	for (int it = 0; it < ITERS; it++) {
+		unsigned r = next_rand(&seed);
+		slot_t *slot = &slots[r % SLOTS];
+		size_t size = rand_size(&seed);
+
+		if (slot->addr != NULL) {
+			verify(slot, slot->size);
+			if ((r >> 12) % 4 == 0) {
+				// Resize: the contents up to the smaller size survive
+				unsigned char *addr = realloc(slot->addr, size);
+
+				CHECK(addr != NULL);
+				slot->addr = addr;
+				verify(slot, slot->size < size ? slot->size : size);
+				fill(slot, addr, size, &seed);
+			} else {
+				free(slot->addr);
+				slot->addr = NULL;
+			}
+			continue;
+		}
+
+		switch ((r >> 12) % 4) {
+		case 0: {
+			unsigned char *addr = calloc(1, size);
+
+			CHECK(addr != NULL);
+			for (size_t i = 0; i < size; i += 61)
+				CHECK(addr[i] == 0);
+			fill(slot, addr, size, &seed);
+			break;
+		}
+		case 1: {
+			// Aligned to a power of two from 8 to 64K
+			size_t align = 8UL << (next_rand(&seed) % 14);
+			void *addr = NULL;
+
+			if (r & 1)
+				CHECK(posix_memalign(&addr, align, size) == 0);
+			else
+				addr = aligned_alloc(align, (size + align - 1) & ~(align - 1));
+			CHECK(((uintptr_t)addr & (align - 1)) == 0);
+			fill(slot, addr, size, &seed);
+			break;
+		}
+		default:
+			fill(slot, malloc(size), size, &seed);
+			CHECK(((uintptr_t)slot->addr & 15) == 0);
+			break;
+		}
+	}
+
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].addr != NULL) {
+			verify(&slots[i], slots[i].size);
+			free(slots[i].addr);
+		}
+	}
+	free(slots);
+
+	return NULL;
+}
+
+/**
+ * Fork while other threads allocate. A lock one of them held at the fork
+ * would never be released in the child, so the child's allocations are
+ * bounded by an alarm.
+ */
+static void check_fork(void)
+{
+	for (int f = 0; f < FORKS; f++) {
+		pid_t pid = fork();
+		int status;
+
+		CHECK(pid >= 0);
+		if (pid == 0) {
+			alarm(10);
+			for (size_t size = 16; size <= (4 << 20); size <<= 1) {
+				char *addr = malloc(size);
+
+				if (addr == NULL)
+					_exit(EXIT_FAILURE);
+				memset(addr, 1, size);
+				free(addr);
+			}
+			_exit(EXIT_SUCCESS);
+		}
+		CHECK(waitpid(pid, &status, 0) == pid);
+		CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+		usleep(10000);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[THREADS];
+
+	if (argc > 1) {
+		Dl_info info;
+
+		CHECK(dladdr((void *)malloc, &info) != 0 && info.dli_fname != NULL);
+		CHECK(strstr(info.dli_fname, argv[1]) != NULL);
+	}
+
+	for (int t = 0; t < THREADS; t++)
+		CHECK(pthread_create(&threads[t], NULL, traffic, (void *)(uintptr_t)(t + 1)) == 0);
+	check_fork();
+	for (int t = 0; t < THREADS; t++)
+		pthread_join(threads[t], NULL);
+	printf("check_malloc: %-16s ok\n", "traffic");
+
+	return EXIT_SUCCESS;
+}
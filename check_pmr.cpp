@@ -0,0 +1,286 @@
+/**
+ * C++ Checks
+ *
+ * Runs standard containers over a buddy arena through BuddyResource and
+ * BuddyAllocator, and random traffic through BuddyArena, and checks the
+ * results: the elements survive, every block is aligned as its type needs,
+ * and once everything is freed the arena has its whole region free again.
+ * Prints one line per check and exits with failure on the first broken one.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "buddy.hpp"
+
+/**
+ * Exit with failure, naming the check, if cond does not hold
+ */
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            std::fprintf(stderr, "check_pmr: %s: %s:%d: %s\n",          \
+                         current, __FILE__, __LINE__, #cond);           \
+            std::exit(EXIT_FAILURE);                                    \
+        }                                                               \
+    } while (0)
+
+namespace {
+
+enum { ORDER = 26, ELEMS = 100000 };
+
+/* name of the check being run, for failure messages */
+const char *current;
+
+/**
+ * A type aligned to a cache line
+ */
+struct alignas(64) Line {
+    int value;
+};
+
+/**
+ * Check that, once drained, the arena holds its whole region free
+ */
+void check_whole(buddy_arena_t *arena)
+{
+    buddy_stats_t stats;
+
+    buddy_arena_drain(arena);
+    buddy_arena_stats(arena, &stats);
+    CHECK(stats.free_bytes == 1UL << ORDER);
+}
+
+/**
+ * A string long enough to need memory of its own
+ */
+std::string label(int i)
+{
+    return std::to_string(i) + " is a long enough string";
+}
+
+/**
+ * Report that the current check passed
+ */
+void done()
+{
+    std::printf("check_pmr: %-16s ok\n", current);
+}
+
+/**
+ * Fill pmr containers, check their elements, then let them go
+ */
+void check_containers(BuddyResource &buddy)
+{
+    current = "containers";
+    {
+        std::pmr::vector<int> vec(&buddy);
+        std::pmr::list<int> list(&buddy);
+        std::pmr::unordered_map<int, std::pmr::string> map(&buddy);
+
+        for (int i = 0; i < ELEMS; i++) {
+            vec.push_back(i);
+            list.push_back(-i);
+            if (i % 10 == 0)
+                map.emplace(i, std::pmr::string(label(i).c_str(), &buddy));
+        }
+
+        for (int i = 0; i < ELEMS; i++)
+            CHECK(vec[i] == i);
+
+        int i = 0;
+
+        for (int v : list)
+            CHECK(v == -i++);
+        for (auto &kv : map)
+            CHECK(kv.second.c_str() == label(kv.first));
+    }
+    check_whole(buddy.arena());
+    done();
+}
+
+/**
+ * Containers of over-aligned elements, and raw allocations at every
+ * power-of-two alignment up to 64K
+ */
+void check_aligned(BuddyResource &buddy)
+{
+    current = "aligned";
+    {
+        std::pmr::vector<Line> lines(&buddy);
+        std::pmr::list<Line> nodes(&buddy);
+
+        for (int i = 0; i < 1000; i++) {
+            lines.push_back(Line{i});
+            nodes.push_back(Line{i});
+            CHECK(reinterpret_cast<std::uintptr_t>(lines.data()) % alignof(Line) == 0);
+            CHECK(reinterpret_cast<std::uintptr_t>(&nodes.back()) % alignof(Line) == 0);
+        }
+        for (int i = 0; i < 1000; i++)
+            CHECK(lines[i].value == i);
+    }
+
+    std::pmr::memory_resource *r = &buddy;
+
+    for (std::size_t align = 1; align <= 1 << 16; align <<= 1) {
+        for (std::size_t bytes : {std::size_t(1), align / 2 + 1, align, 3 * align + 5}) {
+            void *p = r->allocate(bytes, align);
+
+            CHECK(reinterpret_cast<std::uintptr_t>(p) % align == 0);
+            r->deallocate(p, bytes, align);
+        }
+    }
+    check_whole(buddy.arena());
+
+    // A caller's region 64 bytes past a page boundary cannot meet a page
+    // alignment, whatever block is free
+    alignas(4096) static char region[2 << 16];
+    buddy_arena_t *arena = buddy_arena_create(region + 64, 1 << 16, 6, 16, 0);
+    BuddyResource offset(arena);
+    bool threw = false;
+
+    CHECK(arena != nullptr);
+    try {
+        offset.deallocate(offset.allocate(10, 4096), 10, 4096);
+    } catch (const std::bad_alloc &) {
+        threw = true;
+    }
+    CHECK(threw);
+
+    void *p = offset.allocate(10, 64);
+
+    CHECK(reinterpret_cast<std::uintptr_t>(p) % 64 == 0);
+    offset.deallocate(p, 10, 64);
+    buddy_arena_destroy(arena);
+    done();
+}
+
+/**
+ * Standard containers through BuddyAllocator, and its equality
+ */
+void check_allocator(BuddyResource &buddy)
+{
+    current = "allocator";
+    {
+        BuddyAllocator<int> alloc(&buddy);
+        std::vector<int, BuddyAllocator<int>> vec(alloc);
+        std::list<Line, BuddyAllocator<Line>> list(alloc);
+
+        for (int i = 0; i < ELEMS; i++)
+            vec.push_back(i);
+        for (int i = 0; i < 1000; i++) {
+            list.push_back(Line{i});
+            CHECK(reinterpret_cast<std::uintptr_t>(&list.back()) % alignof(Line) == 0);
+        }
+        for (int i = 0; i < ELEMS; i++)
+            CHECK(vec[i] == i);
+
+        BuddyResource other(buddy.arena());
+
+        CHECK(alloc == BuddyAllocator<long>(&buddy));
+        CHECK(alloc != BuddyAllocator<int>(nullptr));
+        CHECK(buddy.is_equal(other));
+    }
+    check_whole(buddy.arena());
+    done();
+}
+
+/**
+ * Random traffic through a BuddyArena: blocks are sized, aligned to their
+ * size within the region and keep their contents, and once they are freed
+ * the region is one block again
+ */
+template <int MinOrder, int MaxOrder>
+void check_arena(BuddyArena<MinOrder, MaxOrder> &arena)
+{
+    using Arena = BuddyArena<MinOrder, MaxOrder>;
+    struct Slot {
+        unsigned char *addr;
+        std::size_t size;
+        unsigned char fill;
+    };
+    static Slot slots[512];
+    unsigned seed = MaxOrder;
+
+    for (int it = 0; it < ELEMS; it++) {
+        seed = seed * 1103515245 + 12345;
+
+        Slot &slot = slots[(seed >> 8) % 512];
+
+        if (slot.addr != nullptr) {
+            for (std::size_t i = 0; i < slot.size; i += 61)
+                CHECK(slot.addr[i] == slot.fill);
+            arena.free(slot.addr);
+            slot.addr = nullptr;
+            continue;
+        }
+
+        std::size_t size = 1 + (seed >> 4) % (std::size_t(1) << (MaxOrder - 4));
+        std::size_t block = std::size_t(1) << Arena::order_of(size);
+
+        slot.addr = static_cast<unsigned char *>(arena.alloc(size));
+        if (slot.addr == nullptr)
+            continue;
+        CHECK(block >= size && Arena::order_of(size) >= MinOrder);
+        CHECK(std::size_t(slot.addr - static_cast<unsigned char *>(arena.memory())) % block == 0);
+        slot.size = size;
+        slot.fill = (seed >> 16) | 1;
+        std::memset(slot.addr, slot.fill, size);
+    }
+    for (Slot &slot : slots) {
+        arena.free(slot.addr);
+        slot.addr = nullptr;
+    }
+
+    CHECK(arena.free_bytes() == Arena::region_size);
+    CHECK(arena.alloc(Arena::region_size + 1) == nullptr);
+    CHECK(arena.alloc(Arena::region_size) == arena.memory());
+    CHECK(arena.free_bytes() == 0);
+    arena.reset();
+    CHECK(arena.free_bytes() == Arena::region_size);
+}
+
+/**
+ * BuddyArena over a mapped region of its own and over a caller's region
+ */
+void check_arenas()
+{
+    current = "arena";
+    static_assert(BuddyArena<12, 20>::order_of(1) == 12);
+    static_assert(BuddyArena<12, 20>::order_of(4097) == 13);
+    static_assert(BuddyArena<12, 20>::order_of(1 << 20) == 20);
+    static_assert(BuddyArena<12, 20>::order_of((1 << 20) + 1) == 21);
+    {
+        auto mapped = std::make_unique<BuddyArena<12, 22>>();
+
+        check_arena(*mapped);
+
+        alignas(1 << 10) static char region[1 << 14];
+        BuddyArena<4, 14> small(region);
+
+        CHECK(small.memory() == region);
+        check_arena(small);
+    }
+    done();
+}
+
+} // namespace
+
+int main()
+{
+    BuddyResource buddy(1UL << ORDER, 12, ORDER);
+
+    check_containers(buddy);
+    check_aligned(buddy);
+    check_allocator(buddy);
+    check_arenas();
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+/**
+ * Malloc Replacement
+ *
+ * Built as libbuddy.so by `make preload`, this library replaces the C
+ * allocation functions of unmodified programs run with LD_PRELOAD. Requests
+ * of up to 1 << MAX_ORDER bytes come from a concurrent buddy heap with slabs
+ * for small sizes; larger ones are mapped on their own. Nothing here or in
+ * the heap calls back into malloc(): all bookkeeping is mapped directly.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+/* make a function visible to the programs it is preloaded into */
+#define EXPORT __attribute__((visibility("default")))
+
+/* order of a page of the heap */
+#define MIN_ORDER 12
+
+/* largest request served by the heap; larger ones get a mapping each */
+#define MAX_ORDER 20
+
+/* order of a heap chunk */
+#define CHUNK_ORDER 26
+
+/* chunks the heap may grow to: 256G of address space */
+#define CHUNKS 4096
+
+/* alignment malloc() guarantees */
+#define MALLOC_ALIGN 16
+
+/**
+ * Header just below a block with a mapping of its own
+ */
+typedef struct large_t {
+	void *base;		///< Start of the mapping
+	size_t len;		///< Length of the mapping
+} large_t;
+
+/* the heap, created by the first call */
+static buddy_heap_t *heap;
+
+/* serializes creating the heap */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The heap, created on first use
+ */
+static buddy_heap_t *get_heap(void)
+{
+	buddy_heap_t *h = __atomic_load_n(&heap, __ATOMIC_ACQUIRE);
+
+	if (h != NULL)
+		return h;
+
+	pthread_mutex_lock(&heap_lock);
+	h = heap;
+	if (h == NULL) {
+		h = buddy_heap_create(MIN_ORDER, CHUNK_ORDER, CHUNKS,
+				      BUDDY_CONCURRENT | BUDDY_SLAB);
+		__atomic_store_n(&heap, h, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&heap_lock);
+
+	return h;
+}
+
+/**
+ * Hold the heap across fork(), so no allocator lock is taken in the parent
+ * when the child starts
+ */
+static void fork_prepare(void)
+{
+	pthread_mutex_lock(&heap_lock);
+	if (heap != NULL)
+		buddy_heap_prefork(heap);
+}
+
+static void fork_parent(void)
+{
+	if (heap != NULL)
+		buddy_heap_postfork_parent(heap);
+	pthread_mutex_unlock(&heap_lock);
+}
+
+static void fork_child(void)
+{
+	if (heap != NULL)
+		buddy_heap_postfork_child(heap);
+	pthread_mutex_init(&heap_lock, NULL);
+}
+
+/**
+ * Install the fork handlers when the library is loaded. Handlers registered
+ * later, which may allocate, run before fork_prepare() and after
+ * fork_child().
+ */
+__attribute__((constructor)) static void preload_init(void)
+{
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/**
+ * Map a block of its own, aligned to at least a page, with its header in
+ * the page below it
+ */
+static void *large_alloc(size_t size, size_t align)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t lead = align > page ? align : page;
+	size_t len = ((size + page - 1) & ~(page - 1)) + lead;
+
+	if (len < size)
+		return NULL;
+
+	char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (base == MAP_FAILED)
+		return NULL;
+
+	char *p = (char *)(((unsigned long)base + sizeof(large_t) + lead - 1) & ~(lead - 1));
+	large_t *hdr = (large_t *)p - 1;
+
+	hdr->base = base;
+	hdr->len = len;
+
+	return p;
+}
+
+/**
+ * Usable bytes of a block with a mapping of its own
+ */
+static size_t large_size(void *p)
+{
+	large_t *hdr = (large_t *)p - 1;
+
+	return (char *)hdr->base + hdr->len - (char *)p;
+}
+
+/**
+ * Allocate size bytes aligned to align, a power of two
+ */
+static void *alloc_aligned(size_t size, size_t align)
+{
+	buddy_heap_t *h = get_heap();
+	void *p = NULL;
+
+	if (align < MALLOC_ALIGN)
+		align = MALLOC_ALIGN;
+
+	if (h != NULL && size <= 1UL << MAX_ORDER && align <= 1UL << MAX_ORDER)
+		p = buddy_heap_alloc_aligned(h, size, align);
+	else
+		p = large_alloc(size, align);
+
+	if (p == NULL)
+		errno = ENOMEM;
+	return p;
+}
+
+/**
+ * Is p a block of the heap, as opposed to one with a mapping of its own?
+ */
+static int in_heap(void *p)
+{
+	buddy_heap_t *h = __atomic_load_n(&heap, __ATOMIC_ACQUIRE);
+
+	return h != NULL && buddy_heap_owns(h, p);
+}
+
+EXPORT void *malloc(size_t size)
+{
+	return alloc_aligned(size, MALLOC_ALIGN);
+}
+
+EXPORT void free(void *p)
+{
+	if (p == NULL)
+		return;
+
+	if (in_heap(p)) {
+		buddy_heap_free(heap, p);
+	} else {
+		large_t *hdr = (large_t *)p - 1;
+
+		munmap(hdr->base, hdr->len);
+	}
+}
+
+EXPORT void *calloc(size_t n, size_t size)
+{
+	size_t bytes;
+
+	if (__builtin_mul_overflow(n, size, &bytes)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Not malloc(): the compiler may fold malloc() and memset() back into
+	// a call to calloc()
+	void *p = alloc_aligned(bytes, MALLOC_ALIGN);
+
+	// A block with a mapping of its own is fresh from the kernel
+	if (p != NULL && bytes <= 1UL << MAX_ORDER)
+		memset(p, 0, bytes);
+	return p;
+}
+
+EXPORT size_t malloc_usable_size(void *p)
+{
+	if (p == NULL)
+		return 0;
+
+	return in_heap(p) ? buddy_heap_block_size(heap, p) : large_size(p);
+}
+
+EXPORT void *realloc(void *p, size_t size)
+{
+	if (p == NULL)
+		return malloc(size);
+
+	if (size == 0) {
+		free(p);
+		return NULL;
+	}
+
+	// Within the heap a block grows and shrinks in place when it can
+	if (in_heap(p) && size <= 1UL << MAX_ORDER) {
+		void *q = buddy_heap_realloc(heap, p, size);
+
+		if (q == NULL)
+			errno = ENOMEM;
+		return q;
+	}
+
+	size_t old = malloc_usable_size(p);
+
+	if (!in_heap(p) && size <= old && size > 1UL << MAX_ORDER)
+		return p;
+
+	void *q = malloc(size);
+
+	if (q == NULL)
+		return NULL;
+
+	memcpy(q, p, old < size ? old : size);
+	free(p);
+	return q;
+}
+
+EXPORT void *reallocarray(void *p, size_t n, size_t size)
+{
+	size_t bytes;
+
+	if (__builtin_mul_overflow(n, size, &bytes)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return realloc(p, bytes);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	if (align < sizeof(void *) || (align & (align - 1)) != 0)
+		return EINVAL;
+
+	void *p = alloc_aligned(size, align);
+
+	if (p == NULL)
+		return ENOMEM;
+
+	*memptr = p;
+	return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return alloc_aligned(size, align);
+}
+
+EXPORT void *memalign(size_t align, size_t size)
+{
+	return aligned_alloc(align, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+	return alloc_aligned(size, sysconf(_SC_PAGESIZE));
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return alloc_aligned((size + page - 1) & ~(page - 1), page);
+}
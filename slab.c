@@ -0,0 +1,409 @@
+/**
+ * Slab Allocator
+ *
+ * Serves requests of up to SLAB_MAX_SIZE bytes from buddy blocks carved into
+ * objects of one size class. Each slab starts with a header holding a bitmap
+ * of its free objects; the pages of a slab are marked in the arena's page
+ * structures, which is how a freed object finds its way back to its slab.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "list.h"
+#include "slab.h"
+
+/* number of size classes */
+#define SLAB_CLASSES 14
+
+/* a slab block is made large enough for at least this many objects */
+#define SLAB_MIN_OBJS 8
+
+#define BITS_PER_WORD (8 * (int)sizeof(unsigned long))
+
+/* words needed for n bits */
+#define BITMAP_WORDS(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+/**
+ * Object sizes of the classes: powers of two with a step halfway between each
+ * pair, so no more than a third of an object is lost to rounding.
+ */
+static const size_t class_size[SLAB_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+/**
+ * Class of each size up to SLAB_MAX_SIZE, indexed by the size in SLAB_ALIGN
+ * units rounded up
+ */
+static const unsigned char class_index[SLAB_MAX_SIZE / SLAB_ALIGN + 1] = {
+	[0 ... 1] = 0, [2] = 1, [3] = 2, [4] = 3, [5 ... 6] = 4, [7 ... 8] = 5,
+	[9 ... 12] = 6, [13 ... 16] = 7, [17 ... 24] = 8, [25 ... 32] = 9,
+	[33 ... 48] = 10, [49 ... 64] = 11, [65 ... 96] = 12, [97 ... 128] = 13
+};
+
+/**
+ * Header at the start of every slab
+ */
+typedef struct slab_t {
+	struct list_head list;	///< Link on the class's list of partial slabs
+	int cls;		///< Size class of the objects
+	int nfree;		///< Number of free objects
+	unsigned long free[];	///< Bit i set while object i is free
+} slab_t;
+
+/**
+ * One size class: its slab geometry and the slabs that still have room
+ */
+typedef struct slab_class_t {
+	pthread_mutex_t lock;		///< Guards the class in concurrent arenas
+	struct list_head partial;	///< Slabs with at least one free object
+	int npartial;			///< Number of slabs on partial
+	int order;			///< Order of a slab block, -1 if the class is unused
+	int nobjs;			///< Objects per slab
+	long nused;			///< Objects handed out and not yet freed
+	size_t size;			///< Object size
+	size_t offset;			///< Offset of the first object from the header
+} __attribute__((aligned(64))) slab_class_t;
+
+struct slab_cache {
+	slab_class_t classes[SLAB_CLASSES];	///< Size classes, smallest first
+	buddy_arena_t *arena;			///< Arena the slab blocks come from
+	int concurrent;				///< Lock the classes?
+	int kept;				///< Set once a class keeps an empty slab, until a shrink
+};
+
+/**
+ * Find the smallest class holding size bytes
+ *
+ * @return class index, or -1 if size is over SLAB_MAX_SIZE
+ */
+static inline int size_class(size_t size)
+{
+	if (size > SLAB_MAX_SIZE)
+		return -1;
+
+	return class_index[(size + SLAB_ALIGN - 1) / SLAB_ALIGN];
+}
+
+/**
+ * Alignment of the objects of a class: the largest power of two dividing the
+ * object size, so the objects of power-of-two classes are aligned to their
+ * size
+ */
+static inline size_t class_align(size_t size)
+{
+	return size & -size;
+}
+
+/**
+ * Work out the slab geometry of a class: the smallest block order holding
+ * SLAB_MIN_OBJS objects, and how many objects fit after the header. The
+ * objects start on a multiple of the class alignment, which costs no object
+ * in any class.
+ */
+static void class_init(slab_class_t *c, size_t size, int min_order, int max_order)
+{
+	int order = min_order;
+
+	while ((1UL << order) < SLAB_MIN_OBJS * size)
+		order++;
+
+	c->size = size;
+	c->order = order <= max_order ? order : -1;
+
+	if (c->order < 0)
+		return;
+
+	size_t bytes = 1UL << order;
+	int n = bytes / size;
+
+	do {
+		c->offset = sizeof(slab_t) + BITMAP_WORDS(n) * sizeof(unsigned long);
+		c->offset = (c->offset + class_align(size) - 1) & ~(class_align(size) - 1);
+	} while (c->offset + n * size > bytes && --n > 0);
+
+	c->nobjs = n;
+}
+
+/**
+ * Lock a class, if the arena is concurrent
+ */
+static void class_lock(slab_cache_t *cache, slab_class_t *c)
+{
+	if (cache->concurrent)
+		pthread_mutex_lock(&c->lock);
+}
+
+/**
+ * Unlock a class, if the arena is concurrent
+ */
+static void class_unlock(slab_cache_t *cache, slab_class_t *c)
+{
+	if (cache->concurrent)
+		pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Create the size classes of an arena
+ *
+ * @param arena Arena the slab blocks come from
+ * @param min_order Order of the arena's pages
+ * @param max_order Order of the arena's largest block
+ * @param concurrent Non-zero if the arena is used from many threads
+ * @return The cache, or NULL if out of memory
+ */
+slab_cache_t *slab_cache_create(buddy_arena_t *arena, int min_order, int max_order,
+                                int concurrent)
+{
+	/* mapped, not allocated, so slabs can sit behind malloc() itself */
+	slab_cache_t *cache = mmap(NULL, sizeof(slab_cache_t), PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (cache == MAP_FAILED)
+		return NULL;
+
+	cache->arena = arena;
+	cache->concurrent = concurrent;
+
+	for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+		pthread_mutex_init(&cache->classes[cls].lock, NULL);
+		class_init(&cache->classes[cls], class_size[cls], min_order, max_order);
+	}
+
+	slab_cache_reset(cache);
+
+	return cache;
+}
+
+/**
+ * Release the size classes. Their slab blocks belong to the arena.
+ */
+void slab_cache_destroy(slab_cache_t *cache)
+{
+	for (int cls = 0; cls < SLAB_CLASSES; cls++)
+		pthread_mutex_destroy(&cache->classes[cls].lock);
+
+	munmap(cache, sizeof(slab_cache_t));
+}
+
+/**
+ * Forget every slab, after the arena has been reset
+ */
+void slab_cache_reset(slab_cache_t *cache)
+{
+	for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+		INIT_LIST_HEAD(&cache->classes[cls].partial);
+		cache->classes[cls].npartial = 0;
+		cache->classes[cls].nused = 0;
+	}
+	cache->kept = 0;
+}
+
+/**
+ * Give every empty slab back to the arena
+ */
+void slab_cache_shrink(slab_cache_t *cache)
+{
+	__atomic_store_n(&cache->kept, 0, __ATOMIC_RELAXED);
+
+	for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+		slab_class_t *c = &cache->classes[cls];
+		struct list_head *pos, *n;
+
+		class_lock(cache, c);
+		list_for_each_safe(pos, n, &c->partial) {
+			slab_t *slab = list_entry(pos, slab_t, list);
+
+			if (slab->nfree == c->nobjs) {
+				list_del(&slab->list);
+				c->npartial--;
+				buddy_slab_block_free(cache->arena, slab);
+			}
+		}
+		class_unlock(cache, c);
+	}
+}
+
+/**
+ * Would shrinking leave the cache holding no slabs at all: has a class kept
+ * an empty slab, with no object of any class in use? The counts are read
+ * without the class locks, so the answer may be stale.
+ */
+int slab_cache_idle(slab_cache_t *cache)
+{
+	if (!__atomic_load_n(&cache->kept, __ATOMIC_RELAXED))
+		return 0;
+
+	for (int cls = 0; cls < SLAB_CLASSES; cls++)
+		if (__atomic_load_n(&cache->classes[cls].nused, __ATOMIC_RELAXED) != 0)
+			return 0;
+
+	return 1;
+}
+
+/**
+ * Allocate an object of a class
+ *
+ * @return The object, or NULL if the class is unused or the arena is full
+ */
+static void *class_alloc(slab_cache_t *cache, int cls)
+{
+	if (cls < 0 || cache->classes[cls].order < 0)
+		return NULL;
+
+	slab_class_t *c = &cache->classes[cls];
+	slab_t *slab;
+
+	class_lock(cache, c);
+
+	// Start a new slab when every slab of the class is full
+	if (list_empty(&c->partial)) {
+		slab = buddy_slab_block_alloc(cache->arena, c->order);
+
+		if (slab == NULL) {
+			class_unlock(cache, c);
+			return NULL;
+		}
+
+		slab->cls = cls;
+		slab->nfree = c->nobjs;
+		memset(slab->free, 0, BITMAP_WORDS(c->nobjs) * sizeof(unsigned long));
+		for (int i = 0; i < c->nobjs; i++)
+			slab->free[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+
+		list_add(&slab->list, &c->partial);
+		c->npartial++;
+	}
+
+	slab = list_entry(c->partial.next, slab_t, list);
+
+	int w = 0;
+
+	while (slab->free[w] == 0)
+		w++;
+
+	int i = w * BITS_PER_WORD + __builtin_ctzl(slab->free[w]);
+
+	slab->free[w] &= ~(1UL << (i % BITS_PER_WORD));
+
+	if (--slab->nfree == 0) {
+		list_del(&slab->list);
+		c->npartial--;
+	}
+
+	__atomic_store_n(&c->nused, c->nused + 1, __ATOMIC_RELAXED);
+	class_unlock(cache, c);
+
+	return (char *)slab + c->offset + i * c->size;
+}
+
+/**
+ * Allocate an object of the smallest class holding size bytes
+ *
+ * @param cache Size classes of the arena
+ * @param size Size in bytes
+ * @return The object, or NULL if size has no class or the arena is full
+ */
+void *slab_alloc(slab_cache_t *cache, size_t size)
+{
+	return class_alloc(cache, size_class(size));
+}
+
+/**
+ * Allocate an object of the smallest class holding size bytes whose objects
+ * are aligned to align. Slab blocks are aligned to their size within the
+ * region, which is larger than any object, so the object is aligned in
+ * memory as far as the region is.
+ *
+ * @param cache Size classes of the arena
+ * @param size Size in bytes
+ * @param align Alignment in bytes, a power of two
+ * @return The object, or NULL if no class holds size bytes at align or the
+ *         arena is full
+ */
+void *slab_alloc_aligned(slab_cache_t *cache, size_t size, size_t align)
+{
+	int cls = size_class(size > align ? size : align);
+
+	// The power-of-two class at or above the size is aligned enough
+	while (cls >= 0 && cls < SLAB_CLASSES && class_align(class_size[cls]) < align)
+		cls++;
+
+	return cls < SLAB_CLASSES ? class_alloc(cache, cls) : NULL;
+}
+
+/**
+ * Find the class that would serve size bytes
+ *
+ * @param cache Size classes of the arena
+ * @param size Size in bytes
+ * @param order Set to the order of the class's slab blocks
+ * @param usable Set to the object size of the class
+ * @return The class index, or -1 if size has no class in this cache
+ */
+int slab_size_class(slab_cache_t *cache, size_t size, int *order, size_t *usable)
+{
+	int cls = size_class(size);
+
+	if (cls < 0 || cache->classes[cls].order < 0)
+		return -1;
+
+	*order = cache->classes[cls].order;
+	*usable = cache->classes[cls].size;
+	return cls;
+}
+
+/**
+ * Size of the objects of a slab
+ *
+ * @param cache Size classes of the arena
+ * @param slab Start of the slab block
+ */
+size_t slab_size(slab_cache_t *cache, void *slab)
+{
+	return cache->classes[((slab_t *)slab)->cls].size;
+}
+
+/**
+ * Free an object back to its slab
+ *
+ * A slab that becomes empty goes back to the arena, unless it is the last
+ * slab of its class with free objects.
+ *
+ * @param cache Size classes of the arena
+ * @param slab Start of the slab block holding the object
+ * @param obj The object
+ */
+void slab_free(slab_cache_t *cache, void *slab, void *obj)
+{
+	slab_t *s = slab;
+	slab_class_t *c = &cache->classes[s->cls];
+	int i = ((char *)obj - (char *)s - c->offset) / c->size;
+
+	class_lock(cache, c);
+
+	s->free[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+	__atomic_store_n(&c->nused, c->nused - 1, __ATOMIC_RELAXED);
+
+	if (++s->nfree == 1) {
+		list_add(&s->list, &c->partial);
+		c->npartial++;
+	}
+
+	if (s->nfree == c->nobjs && c->npartial > 1) {
+		list_del(&s->list);
+		c->npartial--;
+		class_unlock(cache, c);
+		buddy_slab_block_free(cache->arena, s);
+		return;
+	}
+
+	// Written only when it changes, as every free of a heap chunk reads it
+	if (s->nfree == c->nobjs && !__atomic_load_n(&cache->kept, __ATOMIC_RELAXED))
+		__atomic_store_n(&cache->kept, 1, __ATOMIC_RELAXED);
+
+	class_unlock(cache, c);
+}
@@ -0,0 +1,36 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#include "buddy.h"
+
+/* largest request served from slabs */
+#define SLAB_MAX_SIZE 2048
+
+/* alignment every object has at least */
+#define SLAB_ALIGN 16
+
+/**
+ * The size classes of one arena, each carving buddy blocks into fixed-size
+ * objects
+ */
+typedef struct slab_cache slab_cache_t;
+
+slab_cache_t *slab_cache_create(buddy_arena_t *arena, int min_order, int max_order,
+                                int concurrent);
+void slab_cache_destroy(slab_cache_t *cache);
+void slab_cache_reset(slab_cache_t *cache);
+void slab_cache_shrink(slab_cache_t *cache);
+int slab_cache_idle(slab_cache_t *cache);
+void *slab_alloc(slab_cache_t *cache, size_t size);
+void *slab_alloc_aligned(slab_cache_t *cache, size_t size, size_t align);
+void slab_free(slab_cache_t *cache, void *slab, void *obj);
+int slab_size_class(slab_cache_t *cache, size_t size, int *order, size_t *usable);
+size_t slab_size(slab_cache_t *cache, void *slab);
+
+/* provided by buddy.c: blocks whose pages are marked as belonging to a slab */
+void *buddy_slab_block_alloc(buddy_arena_t *arena, int order);
+void buddy_slab_block_free(buddy_arena_t *arena, void *block);
+
+#endif // SLAB_H